@@ -36,7 +36,7 @@
 #include <stddef.h>
 
 /* bump this when struct clamma_txf_info layout changes */
-#define CLAMMA_API_VERSION	0xabcd0101
+#define CLAMMA_API_VERSION	0xabcd010c
 
 #define TOK_BOS (1)
 #define TOK_EOS (2)
@@ -63,6 +63,13 @@ typedef pthread_t clamma_thread_t;
 #define clamma_mutex_lock(x)    pthread_mutex_lock(x)
 #define clamma_mutex_unlock(x)  pthread_mutex_unlock(x)
 
+typedef pthread_cond_t clamma_cond_t;
+
+#define clamma_cond_init(x)     pthread_cond_init(x, NULL)
+#define clamma_cond_destroy(x)  pthread_cond_destroy(x)
+#define clamma_cond_wait(x, m)  pthread_cond_wait(x, m)
+#define clamma_cond_broadcast(x) pthread_cond_broadcast(x)
+
 #if defined(__APPLE__)
 #include <dispatch/dispatch.h>
 
@@ -81,6 +88,18 @@ typedef sem_t clamma_sem_t;
 #endif
 
 #endif
+#elif defined(LIBCLAMMA_WITH_OPENMP)
+#include <omp.h>
+
+/* application threads can still share sessions and transformers */
+
+typedef omp_lock_t clamma_mutex_t;
+
+#define clamma_mutex_init(x)    omp_init_lock(x)
+#define clamma_mutex_destroy(x) omp_destroy_lock(x)
+#define clamma_mutex_lock(x)    omp_set_lock(x)
+#define clamma_mutex_unlock(x)  omp_unset_lock(x)
+
 #else
 
 #define clamma_mutex_init(x)
@@ -114,6 +133,40 @@ typedef enum {
 	CLAMMA_MODEL_CHAT /**< use llama2 chat style <<SYS>> */
 } clamma_model_type_t;
 
+typedef enum {
+	CLAMMA_ADMIT_REJECT, /**< fail the query if its kv cache won't fit */
+	CLAMMA_ADMIT_SHRINK, /**< reduce the query limit to what will fit */
+	CLAMMA_ADMIT_QUEUE /**< wait until enough memory is released */
+} clamma_admission_t;
+
+typedef enum {
+	CLAMMA_NUMA_DEFAULT, /**< leave memory placement to the OS */
+	CLAMMA_NUMA_BIND, /**< place memory on the nodes of the cpus we use */
+	CLAMMA_NUMA_INTERLEAVE /**< spread memory over the nodes evenly */
+} clamma_numa_t;
+
+/*
+ * Options for CLAMMA_MODEL_ACCESS_MMAP, or'd together in info.mmap_flags.  The
+ * madvise() ones and hugepages are only effective on Linux.
+ */
+
+enum {
+	CLAMMA_MMAP_POPULATE		= (1 << 0), /**< fault it all in at construct */
+	CLAMMA_MMAP_WILLNEED		= (1 << 1), /**< start async readahead of it all */
+	CLAMMA_MMAP_SEQUENTIAL		= (1 << 2), /**< aggressive readahead, pages may be
+						     * dropped soon after use */
+	CLAMMA_MMAP_HUGEPAGE		= (1 << 3), /**< ask for transparent hugepages on
+						     * the file mapping */
+	CLAMMA_MMAP_MLOCK		= (1 << 4), /**< lock it in memory so it can't be
+						     * reclaimed */
+	CLAMMA_MMAP_PREWARM		= (1 << 5), /**< fault it in from a background
+						     * thread (needs threading) */
+	CLAMMA_MMAP_HUGETLB_COPY	= (1 << 6), /**< copy it into hugetlbfs pages, or
+						     * transparent hugepages if none are
+						     * reserved, instead of mapping the
+						     * file */
+};
+
 /*
  * Transformer and session construction use the same info struct, in the
  * common case you only have one session, you can just fill it in once
@@ -141,15 +194,67 @@ typedef struct clamma_txf_info {
 	void			*model_base;
 	/**> 0 or byte count of model if CLAMMA_MODEL_ACCESS_ABSOLUTE_ADDRESS */
 	size_t			model_size;
-	/**> 0 or max malloc cache limit for CLAMMA_MODEL_ACCESS_MALLOC_CACHE */
+	/**> 0 or max malloc cache limit for CLAMMA_MODEL_ACCESS_MALLOC_CACHE,
+	 * each transformer has its own cache */
 	size_t			cache_limit;
+	/**> 0, or max bytes of memory for CLAMMA_MODEL_ACCESS_MALLOC_CACHE to
+	 * keep blocks evicted from the cache_limit in, compressed, so they
+	 * can be decompressed instead of read from the file again */
+	size_t			cache_compressed_limit;
+	/**> 0, or 1 for CLAMMA_MODEL_ACCESS_MALLOC_CACHE to read the model
+	 * with O_DIRECT, so it's not also held in the page cache.  Only
+	 * effective with LIBCLAMMA_THREADING=PTHREADS on Linux. */
+	unsigned int		cache_direct_io;
+	/**> 0, or CLAMMA_MMAP_* flags for CLAMMA_MODEL_ACCESS_MMAP */
+	unsigned int		mmap_flags;
+	/**> 0, or count of dequantized token embedding rows to keep for int8
+	 * models, which otherwise dequantize each token's row when used */
+	unsigned int		embed_cache_rows;
 	/**> 0 for default (8 if smp enabled, 1 if single-threaded), else count
-	 * of threads to spawn for concurrent matrix math processing */
+	 * of threads to spawn for concurrent matrix math processing, or the
+	 * OpenMP team size with LIBCLAMMA_THREADING=OPENMP */
 	unsigned int		threads;
+	/**> NULL for this transformer to have its own pool of SMP threads,
+	 * else name of a pool to share with other transformers.  The first
+	 * transformer naming the pool creates it with its threads, cpus and
+	 * numa settings, later ones just attach to it. */
+	const char		*pool_name;
+	/**> 0, or 1 to time a few forwards at construct with 1, 2, 4...
+	 * threads up to threads (or the online cpus if 0), and keep the
+	 * fastest.  Ignored if pool_name is set. */
+	unsigned int		tune_threads;
+	/**> NULL, or path to a file caching tune_threads results per model
+	 * and host, so later constructs skip the timing */
+	const char		*tune_cache;
 	/**> CLAMMA_MODEL_GEN or CLAMMA_MODEL_CHAT */
 	clamma_model_type_t	model_type;
 	/**> 0 for unlimited, or max sessions allowed */
 	unsigned int		max_sessions;
+	/**> 0 for unlimited, or max bytes of session state (including each
+	 * query's kv cache) allowed to be reserved on this transformer */
+	size_t			mem_budget;
+	/**> 0, or count of sessions to preallocate, including their kv cache
+	 * for the full model seq_len, so constructing and destroying sessions
+	 * just takes and returns one from the pool */
+	unsigned int		session_pool;
+	/**> 0 for default (50us if there are more cpus than threads, else
+	 * none), -1 to never spin, else how many us SMP workers and sessions
+	 * waiting on them spin before sleeping */
+	int			spin_us;
+	/**> NULL to not pin, else cpu list like "0-7,16-23" that this
+	 * transformer's SMP worker threads are pinned across, one cpu each */
+	const char		*cpus;
+	/**> NUMA placement of model and cache memory, on the nodes of the
+	 * cpus list if given, else all nodes.  Only memory we allocate can be
+	 * placed: the HUGETLB_COPY model copy, MALLOC_CACHE blocks and
+	 * replicas, a plain file mapping stays wherever the page cache has
+	 * it.  Only effective on Linux. */
+	clamma_numa_t		numa;
+	/**> 0, or 1 to copy the model into memory on each NUMA node, so SMP
+	 * workers read their weights from their own node.  This costs the
+	 * model size per node, and needs MMAP or ABSOLUTE_ADDRESS access.
+	 * Without a cpus list, the workers are spread over the nodes. */
+	unsigned int		numa_replicate;
 	/**> UI name for this transformer, or empty string */
 	char			name[32];
 	/**> NULL, or buffer to receive model configuration description */
@@ -181,6 +286,8 @@ typedef struct clamma_txf_info {
 	uint64_t		rng_seed;
 	/**> NULL, or pointer to pointer to set to NULL on session destroy */
 	void			**null_on_destroy;
+	/**> what to do if the query's kv cache doesn't fit in mem_budget */
+	clamma_admission_t	admission;
 
 } clamma_txf_info_t;
 
@@ -211,6 +318,73 @@ CLAMMA_VISIBLE void
 clamma_txf_destroy(struct txf *t);
 
 
+/**
+ * clamma_txf_headroom() - bytes left in the transformer memory budget
+ *
+ * \p t: the transformer
+ *
+ * Returns how many bytes of the transformer's mem_budget are not reserved by
+ * its sessions and their queries, or SIZE_MAX if it has no budget.  Sessions
+ * reserve their fixed state at construction, and their kv cache, sized by the
+ * query limit, when the query is admitted.
+ */
+CLAMMA_VISIBLE size_t
+clamma_txf_headroom(const struct txf *t);
+
+/*
+ * Live counters for a transformer, see clamma_txf_stats().  The cache
+ * members are only nonzero with CLAMMA_MODEL_ACCESS_MALLOC_CACHE.
+ */
+
+typedef struct clamma_txf_stats {
+	/**> bytes read from the model file into the cache */
+	uint64_t		bytes_read;
+	/**> bytes of cached weights used by forwards */
+	uint64_t		bytes_touched;
+	/**> bytes currently held in the cache */
+	uint64_t		resident;
+	/**> cache blocks created, including ones since evicted */
+	uint64_t		blocks_created;
+	/**> cache lookups finding the block already there */
+	uint64_t		hits;
+	/**> cache lookups that had to read the block */
+	uint64_t		misses;
+	/**> blocks read ahead by the prefetch thread */
+	uint64_t		prefetched;
+	/**> blocks evicted to stay under cache_limit */
+	uint64_t		evictions;
+	/**> total us forwards spent waiting for reads into the cache */
+	uint64_t		stall_us;
+	/**> major page faults of the whole process so far, eg, from faulting
+	 * in an mmap'd model (0 where getrusage() is unavailable) */
+	uint64_t		major_faults;
+	/**> misses served from the compressed tier instead of the file */
+	uint64_t		compressed_hits;
+	/**> blocks compressed into the compressed tier */
+	uint64_t		compressed_stored;
+	/**> bytes currently held in the compressed tier */
+	uint64_t		compressed_resident;
+	/**> hits / (hits + misses), or 0 if no lookups yet */
+	float			hit_ratio;
+} clamma_txf_stats_t;
+
+/**
+ * clamma_txf_stats() - get live statistics for a transformer
+ *
+ * \p t: the transformer
+ * \p st: struct to fill with the counters
+ *
+ * Fills \p st with a consistent snapshot of the transformer's weight cache
+ * counters, and the process major fault count.  It's cheap and may be called
+ * from any thread while the transformer is in use, eg, to poll it periodically.
+ * The counters are cumulative since the transformer was constructed.
+ *
+ * Returns 0 on success, or 1 if the fault count couldn't be read (the rest of
+ * \p st is still valid).
+ */
+CLAMMA_VISIBLE int
+clamma_txf_stats(const struct txf *t, clamma_txf_stats_t *st);
+
 /**
  * \b clamma_session_construct() - construct a clamma transformer session
  *
@@ -220,6 +394,9 @@ clamma_txf_destroy(struct txf *t);
  * On success, returns an opaque pointer to an allocated and initialized +
  * configured transformer using the model given in info->checkpoint_path.
  *
+ * If the transformer was created with a session_pool, a preallocated session
+ * is taken from the pool if any are free, otherwise it is allocated.
+ *
  * On failure, returns NULL with nothing allocated.
  */
 CLAMMA_VISIBLE struct txf_session *
@@ -231,6 +408,8 @@ clamma_session_construct(const struct txf *t);
  * \p t: the previously allocated transformer
  *
  * Frees any allocations inside the transformer and then the transformer itself.
+ * Sessions from the transformer's session_pool are instead reset and returned
+ * to the pool.
  */
 CLAMMA_VISIBLE void
 clamma_session_destroy(struct txf_session *ts);
@@ -250,7 +429,10 @@ clamma_session_destroy(struct txf_session *ts);
  * The actual number of tokens to be produced is restricted by the model
  * checkpoint sequence length discovered at runtime.
  *
- * returns 0 if successful.
+ * If the transformer has a mem_budget, the kv cache for the query is reserved
+ * against it, info->admission decides what happens if it doesn't fit.
+ *
+ * returns 0 if successful (including if queued waiting for memory).
  */
 CLAMMA_VISIBLE int
 clamma_session_query(struct txf_session *ts,
@@ -261,14 +443,37 @@ clamma_session_query(struct txf_session *ts,
  *
  * Issues the next token for the next active query session in round-robin mode.
  *
- * Returns 1 if a token was produced, or 0 if there's no longer any active query.
- * Keep calling this to generate the output callbacks for each running query
- * session in turn, until it returns 0 and is idle until another
- * clamma_session_query() is started.
+ * Returns 1 if a token was produced, -1 if a query failed, eg, because its kv
+ * cache couldn't be allocated (its session still issues TOK_EOS and is
+ * destroyed), or 0 if there's no longer any active query.  Keep calling this
+ * to generate the output callbacks for each running query session in turn,
+ * until it returns 0 and is idle until another clamma_session_query() is
+ * started.
  */
 CLAMMA_VISIBLE int
 clamma_sessions_step_next(void);
 
+/**
+ * clamma_session_step() - make the next token for a specific session
+ *
+ * \p ts: the transformer session object
+ *
+ * Issues the next token for the query on this session.  Different application
+ * threads may call this concurrently on different sessions, they share the
+ * SMP worker pool, and it may also be used alongside
+ * clamma_sessions_step_next() on other threads.
+ *
+ * Returns 1 if a token was produced and the query continues, 0 if the query has
+ * completed (the session is not destroyed and may be given a new query), or -1
+ * if the session can't be stepped now, because it has no query, its query is
+ * still waiting for memory, or another thread is stepping it.  -1 is also
+ * returned if the query failed, eg, its kv cache couldn't be allocated, in
+ * which case the query is ended without issuing TOK_EOS, and the session may
+ * be given a new query.
+ */
+CLAMMA_VISIBLE int
+clamma_session_step(struct txf_session *ts);
+
 /**
  * clamma_sessions_query_cancel() - mark session as needing to be cancelled
  *
@@ -281,4 +486,78 @@ clamma_sessions_step_next(void);
 CLAMMA_VISIBLE void
 clamma_sessions_query_cancel(struct txf_session *ts);
 
+/*
+ * Optional engine thread, for applications with their own event loop.  These
+ * need the library built with -DLIBCLAMMA_THREADING=PTHREADS, otherwise
+ * clamma_engine_start() fails.
+ */
+
+/**
+ * clamma_engine_start() - start the engine thread
+ *
+ * The engine thread steps sessions given queries with clamma_engine_submit()
+ * from then on, so the application doesn't need to step them itself.  It
+ * doesn't step sessions given queries with clamma_session_query(), those are
+ * still stepped by the application.  Start it after creating a transformer,
+ * and stop it before destroying the last one.
+ *
+ * Returns 0 if the engine is running, else nonzero.
+ */
+CLAMMA_VISIBLE int
+clamma_engine_start(void);
+
+/**
+ * clamma_engine_stop() - stop the engine thread
+ *
+ * Waits for the engine to finish stepping its current session and exit.
+ */
+CLAMMA_VISIBLE void
+clamma_engine_stop(void);
+
+/**
+ * clamma_engine_fd() - get an fd to poll for engine output
+ *
+ * The fd becomes readable when any session submitted with
+ * clamma_engine_submit() has output waiting for clamma_engine_drain(), and
+ * stops being readable once none has.  Add it to your event loop for POLLIN.
+ * Returns -1 if the engine is not running.
+ */
+CLAMMA_VISIBLE int
+clamma_engine_fd(void);
+
+/**
+ * clamma_engine_submit() - start a query on a session stepped by the engine
+ *
+ * \p ts: the transformer session object
+ * \p info: the query information
+ *
+ * Like clamma_session_query(), except the issue_cb is not called from the
+ * engine thread as tokens are made, the output is buffered on the session until
+ * the application calls clamma_engine_drain().  When the query completes, the
+ * session is not destroyed, the application may destroy it or give it another
+ * query after it has drained the TOK_EOS.  A later query given with
+ * clamma_session_query() takes the session back from the engine, discarding
+ * any output not drained.
+ *
+ * Returns 0 if the query was accepted, else nonzero.
+ */
+CLAMMA_VISIBLE int
+clamma_engine_submit(struct txf_session *ts, const clamma_txf_info_t *info);
+
+/**
+ * clamma_engine_drain() - collect buffered engine output without blocking
+ *
+ * \p ts: the session to drain, or NULL for all sessions with output waiting
+ *
+ * Calls the issue_cb of sessions that have buffered output from the calling
+ * thread, once per session, with everything buffered so far concatenated.  If
+ * the query has completed, the string ends with TOK_EOS, and the callback is
+ * free to destroy the session or give it a new query.  Call this when the fd
+ * from clamma_engine_fd() is readable.
+ *
+ * Returns the number of sessions that had output.
+ */
+CLAMMA_VISIBLE int
+clamma_engine_drain(struct txf_session *ts);
+
 #endif
@@ -0,0 +1,104 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Minimal intrusive doubly-linked list with an owner object that tracks the
+ * head, tail and count.  Adding to either end and removing from anywhere are
+ * O(1), which is what the session run queues need.
+ *
+ * None of these apis do any locking, the caller must hold whatever lock
+ * protects the owner.
+ */
+
+#include "private.h"
+
+void
+clamma_dll2_add_head(clamma_dll2_t *d, clamma_dll2_owner_t *owner)
+{
+	assert(!d->owner);
+
+	d->prev = NULL;
+	d->next = owner->head;
+	if (owner->head)
+		owner->head->prev = d;
+	else
+		owner->tail = d;
+
+	owner->head = d;
+	d->owner = owner;
+	owner->count++;
+}
+
+void
+clamma_dll2_add_tail(clamma_dll2_t *d, clamma_dll2_owner_t *owner)
+{
+	assert(!d->owner);
+
+	d->next = NULL;
+	d->prev = owner->tail;
+	if (owner->tail)
+		owner->tail->next = d;
+	else
+		owner->head = d;
+
+	owner->tail = d;
+	d->owner = owner;
+	owner->count++;
+}
+
+void
+clamma_dll2_remove(clamma_dll2_t *d)
+{
+	clamma_dll2_owner_t *owner = d->owner;
+
+	if (!owner) /* not on any list */
+		return;
+
+	if (d->prev)
+		d->prev->next = d->next;
+	else
+		owner->head = d->next;
+
+	if (d->next)
+		d->next->prev = d->prev;
+	else
+		owner->tail = d->prev;
+
+	assert(owner->count);
+	owner->count--;
+
+	d->prev = d->next = NULL;
+	d->owner = NULL;
+}
+
+clamma_dll2_t *
+clamma_dll2_pop_head(clamma_dll2_owner_t *owner)
+{
+	clamma_dll2_t *d = owner->head;
+
+	if (d)
+		clamma_dll2_remove(d);
+
+	return d;
+}
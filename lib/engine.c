@@ -0,0 +1,361 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Optional engine thread, so applications with their own event loop can run
+ * queries without creating and managing a thread to step sessions themselves.
+ *
+ * The engine thread steps only sessions given to it with
+ * clamma_engine_submit(), and instead of calling the session's issue_cb from
+ * the engine thread, the output is buffered on the session.  When a session
+ * gains buffered output while no session had any, the engine signals a
+ * pollable fd (an eventfd on Linux, otherwise the read end of a pipe), so
+ * there's only one wakeup syscall per time the application drains, not one per
+ * token.  The application's event loop then calls clamma_engine_drain() on its
+ * own thread, which calls the issue_cb there for the buffered output.  The
+ * signal is cleared when no session has output left undrained.
+ */
+
+#include "private.h"
+
+#if defined(LIBCLAMMA_WITH_PTHREADS)
+
+#include <errno.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+static struct {
+	clamma_thread_t		pt;
+	clamma_sem_t		sem_kick;
+	/* protects everything below, and sessions' pending output */
+	clamma_mutex_t		mut;
+	clamma_dll2_owner_t	ready; /* sessions with undrained output */
+	int			fd[2]; /* [0] to poll, [1] to signal */
+	char			running;
+	char			exiting;
+} engine = { .mut = PTHREAD_MUTEX_INITIALIZER, .fd = { -1, -1 } };
+
+static void *
+engine_thread(void *p)
+{
+	char exiting;
+
+	(void)p;
+
+	do {
+		if (clamma_sessions_run_one(1) == -1)
+			/* nothing to step until something kicks us */
+			clamma_sem_wait(&engine.sem_kick);
+
+		clamma_mutex_lock(&engine.mut);
+		exiting = engine.exiting;
+		clamma_mutex_unlock(&engine.mut);
+	} while (!exiting);
+
+	return NULL;
+}
+
+int
+clamma_engine_start(void)
+{
+	if (engine.running)
+		return 0;
+
+#if defined(__linux__)
+	engine.fd[0] = engine.fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (engine.fd[0] < 0)
+		goto bail;
+#else
+	if (pipe(engine.fd))
+		goto bail;
+	fcntl(engine.fd[0], F_SETFL, fcntl(engine.fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(engine.fd[1], F_SETFL, fcntl(engine.fd[1], F_GETFL) | O_NONBLOCK);
+	fcntl(engine.fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(engine.fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	if (clamma_sem_init(&engine.sem_kick))
+		goto bail1;
+
+	engine.exiting = 0;
+	if (pthread_create(&engine.pt, NULL, engine_thread, NULL))
+		goto bail2;
+
+	engine.running = 1;
+
+	return 0;
+
+bail2:
+	clamma_sem_destroy(&engine.sem_kick);
+bail1:
+	close(engine.fd[0]);
+	if (engine.fd[1] != engine.fd[0])
+		close(engine.fd[1]);
+	engine.fd[0] = engine.fd[1] = -1;
+bail:
+	fprintf(stderr, "%s: failed to start engine\n", __func__);
+
+	return 1;
+}
+
+void
+clamma_engine_stop(void)
+{
+	void *vret;
+
+	if (!engine.running)
+		return;
+
+	clamma_mutex_lock(&engine.mut);
+	engine.exiting = 1;
+	clamma_mutex_unlock(&engine.mut);
+
+	clamma_sem_post(&engine.sem_kick);
+	pthread_join(engine.pt, &vret);
+	engine.running = 0;
+
+	clamma_sem_destroy(&engine.sem_kick);
+	close(engine.fd[0]);
+	if (engine.fd[1] != engine.fd[0])
+		close(engine.fd[1]);
+	engine.fd[0] = engine.fd[1] = -1;
+}
+
+int
+clamma_engine_fd(void)
+{
+	return engine.fd[0];
+}
+
+int
+clamma_engine_submit(struct txf_session *ts, const clamma_txf_info_t *info)
+{
+	if (!engine.running)
+		return 1;
+
+	return _session_query(ts, info, 1);
+}
+
+void
+clamma_engine_kick(void)
+{
+	if (engine.running)
+		clamma_sem_post(&engine.sem_kick);
+}
+
+/*
+ * Must hold engine.mut.  Once no session has undrained output, clear the
+ * signal, so a level-triggered poll of the fd doesn't keep waking the app.
+ */
+
+static void
+engine_unsignal(void)
+{
+	uint8_t discard[8];
+
+	if (engine.ready.count || engine.fd[0] < 0)
+		return;
+
+	while (read(engine.fd[0], discard, sizeof(discard)) > 0)
+		;
+}
+
+/*
+ * Called instead of the issue_cb for engine sessions, on the engine thread
+ */
+
+int
+clamma_engine_buffer(txf_session_t *ts, const char *piece)
+{
+	size_t len = strlen(piece);
+	char *p;
+
+	clamma_mutex_lock(&engine.mut);
+
+	if (ts->pend_len + len + 1 > ts->pend_alloc) {
+		p = realloc(ts->pend, ts->pend_len + len + 1 + 256);
+		if (!p) {
+			clamma_mutex_unlock(&engine.mut);
+			return 1;
+		}
+		ts->pend = p;
+		ts->pend_alloc = ts->pend_len + len + 1 + 256;
+	}
+
+	memcpy(ts->pend + ts->pend_len, piece, len + 1);
+	ts->pend_len += len;
+
+	if (!ts->ready.owner) {
+		clamma_dll2_add_tail(&ts->ready, &engine.ready);
+
+		/* only wake the app when the first session becomes ready */
+		if (engine.ready.count == 1) {
+#if defined(__linux__)
+			uint64_t one = 1;
+#else
+			uint8_t one = 1;
+#endif
+			if (write(engine.fd[1], &one, sizeof(one)) < 0 &&
+			    errno != EAGAIN)
+				fprintf(stderr, "%s: signal failed\n", __func__);
+		}
+	}
+
+	clamma_mutex_unlock(&engine.mut);
+
+	return 0;
+}
+
+/*
+ * The session is going away, or its client is, discard any undrained output
+ */
+
+void
+clamma_engine_session_gone(txf_session_t *ts)
+{
+	clamma_mutex_lock(&engine.mut);
+	if (ts->ready.owner) {
+		clamma_dll2_remove(&ts->ready);
+		engine_unsignal();
+	}
+	free(ts->pend);
+	ts->pend = NULL;
+	ts->pend_len = ts->pend_alloc = 0;
+	clamma_mutex_unlock(&engine.mut);
+}
+
+int
+clamma_engine_drain(struct txf_session *ts)
+{
+	char one = !!ts;
+	void *opaque;
+	issue_cb_t cb;
+	int n = 0;
+	char *p;
+
+	do {
+		clamma_mutex_lock(&engine.mut);
+
+		if (!one) {
+			clamma_dll2_t *d;
+
+			d = clamma_dll2_pop_head(&engine.ready);
+			if (!d) {
+				clamma_mutex_unlock(&engine.mut);
+				break;
+			}
+			ts = clamma_container_of(d, txf_session_t, ready);
+		} else {
+			if (!ts->ready.owner) {
+				clamma_mutex_unlock(&engine.mut);
+				break;
+			}
+			clamma_dll2_remove(&ts->ready);
+		}
+
+		engine_unsignal();
+
+		/*
+		 * Take the output away from the session, so the callback is
+		 * free to destroy or requery it
+		 */
+
+		p = ts->pend;
+		ts->pend = NULL;
+		ts->pend_len = ts->pend_alloc = 0;
+		cb = ts->issue_cb;
+		opaque = ts->opaque_user_pointer;
+
+		clamma_mutex_unlock(&engine.mut);
+
+		if (cb && p)
+			cb(opaque, p);
+		free(p);
+		n++;
+	} while (!one);
+
+	return n;
+}
+
+#else
+
+int
+clamma_engine_start(void)
+{
+	fprintf(stderr, "%s: needs LIBCLAMMA_THREADING=PTHREADS\n", __func__);
+
+	return 1;
+}
+
+void
+clamma_engine_stop(void)
+{
+}
+
+int
+clamma_engine_fd(void)
+{
+	return -1;
+}
+
+int
+clamma_engine_submit(struct txf_session *ts, const clamma_txf_info_t *info)
+{
+	(void)ts;
+	(void)info;
+
+	return 1;
+}
+
+int
+clamma_engine_drain(struct txf_session *ts)
+{
+	(void)ts;
+
+	return 0;
+}
+
+void
+clamma_engine_kick(void)
+{
+}
+
+int
+clamma_engine_buffer(txf_session_t *ts, const char *piece)
+{
+	(void)ts;
+	(void)piece;
+
+	return 0;
+}
+
+void
+clamma_engine_session_gone(txf_session_t *ts)
+{
+	(void)ts;
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * A minimal io_uring for the weight cache reader, talking to the kernel
+ * directly so we don't need liburing.  It only gets built on Linux with
+ * -DLIBCLAMMA_THREADING=PTHREADS, and only one thread (the prefetch thread)
+ * uses a given ring.
+ */
+
+#include "private.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct clamma_uring {
+	int		fd;
+
+	void		*sq_ring;
+	size_t		sq_ring_size;
+	unsigned int	*sq_head;
+	unsigned int	*sq_tail;
+	unsigned int	*sq_mask;
+	unsigned int	*sq_array;
+	struct io_uring_sqe *sqes;
+	size_t		sqes_size;
+
+	void		*cq_ring;
+	size_t		cq_ring_size;
+	unsigned int	*cq_head;
+	unsigned int	*cq_tail;
+	unsigned int	*cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned int	to_submit;
+	char		fixed; /* we have registered buffers */
+};
+
+void
+clamma_uring_destroy(clamma_uring_t *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	free(u);
+}
+
+/*
+ * If fixed is given, the buffers are registered with the kernel so reads into
+ * them can skip mapping the pages each time... if it's not allowed, eg, by
+ * RLIMIT_MEMLOCK, we just do normal reads into them
+ */
+
+clamma_uring_t *
+clamma_uring_create(unsigned int depth, const struct iovec *fixed,
+		    unsigned int count_fixed)
+{
+	struct io_uring_params p;
+	clamma_uring_t *u;
+	uint8_t *sq, *cq;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+				p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		goto bail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto bail;
+		}
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto bail;
+	}
+
+	sq = u->sq_ring;
+	u->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = u->cq_ring;
+	u->cq_head  = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (count_fixed && !syscall(__NR_io_uring_register, u->fd,
+				    IORING_REGISTER_BUFFERS, fixed,
+				    count_fixed))
+		u->fixed = 1;
+
+	return u;
+
+bail:
+	clamma_uring_destroy(u);
+
+	return NULL;
+}
+
+/*
+ * Queue a read, it's submitted by the next clamma_uring_wait().  fixed is the
+ * index of the registered buffer buf is in, or -1.  Returns nonzero if the
+ * submission queue is full.
+ */
+
+int
+clamma_uring_queue_read(clamma_uring_t *u, int fd, void *buf, size_t len,
+			uint64_t ofs, int fixed, uint64_t user)
+{
+	unsigned int tail = *u->sq_tail, idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+							*u->sq_mask)
+		return 1;
+
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	if (fixed >= 0 && u->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = (uint16_t)fixed;
+	}
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = ofs;
+	sqe->user_data = user;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+
+	return 0;
+}
+
+/*
+ * Submit anything queued and wait for at least one completion, which is
+ * returned in *user and *res (bytes read, or -errno).  Returns nonzero if the
+ * ring itself failed.
+ */
+
+int
+clamma_uring_wait(clamma_uring_t *u, uint64_t *user, int *res)
+{
+	unsigned int head;
+	int n;
+
+	do {
+		head = *u->cq_head;
+		if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			*user = u->cqes[head & *u->cq_mask].user_data;
+			*res = u->cqes[head & *u->cq_mask].res;
+			__atomic_store_n(u->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+
+			return 0;
+		}
+
+		n = (int)syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1,
+				 IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			return 1;
+		if (n > 0)
+			u->to_submit -= (unsigned int)n;
+	} while (1);
+}
+
+/*
+ * After clamma_uring_wait() failed, reap the completions for the reads the
+ * kernel already took, out of inflight queued, so nothing is still writing
+ * into their buffers when the caller gives up on the ring.  Reads that were
+ * never submitted are just dropped.
+ */
+
+void
+clamma_uring_drain(clamma_uring_t *u, unsigned int inflight)
+{
+	unsigned int head, n = inflight - u->to_submit;
+
+	u->to_submit = 0;
+
+	while (n) {
+		head = *u->cq_head;
+		while (n && head != __atomic_load_n(u->cq_tail,
+						    __ATOMIC_ACQUIRE)) {
+			head++;
+			n--;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+		/*
+		 * We can't rely on io_uring_enter() now, but the kernel posts
+		 * completions anyway, any syscall lets it finish them for us
+		 */
+		if (n)
+			usleep(1000);
+	}
+}
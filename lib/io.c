@@ -0,0 +1,461 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Batched reads from the model file for the weight cache, so a whole layer's
+ * worth of misses can be outstanding at once instead of one pread() at a time.
+ * Requests are split into chunks, which are read using io_uring if we were
+ * built with it and the kernel allows it, otherwise by a small pool of reader
+ * threads.
+ *
+ * With direct io, the model is read with O_DIRECT into aligned bounce slots
+ * and copied out, so the cache doesn't also sit in the page cache.  With
+ * io_uring the slots are registered with the kernel and reused for every
+ * batch.
+ *
+ * This only gets built with -DLIBCLAMMA_THREADING=PTHREADS.
+ */
+
+#include "private.h"
+
+#include <sys/uio.h>
+
+#define CLAMMA_IO_DEPTH		32
+#define CLAMMA_IO_CHUNK		(256 * 1024)
+#define CLAMMA_IO_ALIGN		4096
+#define CLAMMA_IO_THREADS	4
+#define CLAMMA_IO_SLOT		(CLAMMA_IO_CHUNK + 2 * CLAMMA_IO_ALIGN)
+
+typedef struct {
+	clamma_io_req_t	*r;
+	size_t		co; /* offset of the chunk in the request */
+	size_t		len;
+} io_chunk_t;
+
+typedef struct {
+	clamma_io_t	*io;
+	uint8_t		*slot; /* NULL, or the thread's O_DIRECT bounce slot */
+	pthread_t	pt;
+} io_reader_t;
+
+struct clamma_io {
+	int		fd;
+	int		fd_direct; /* -1, or O_DIRECT fd on the model */
+	uint8_t		*slots; /* CLAMMA_IO_DEPTH aligned bounce slots */
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+	clamma_uring_t	*ring;
+	io_chunk_t	inflight[CLAMMA_IO_DEPTH];
+#endif
+
+	io_reader_t	reader[CLAMMA_IO_THREADS];
+	unsigned int	count_threads;
+	pthread_mutex_t	mut;
+	pthread_cond_t	cond_work;
+	pthread_cond_t	cond_done;
+
+	/* the batch being read, protected by mut for the threads */
+	clamma_io_req_t	*r;
+	unsigned int	count;
+	unsigned int	next; /* next request to take a chunk from */
+	size_t		co; /* offset of the next chunk in it */
+	unsigned int	pending; /* chunks not yet completed */
+	char		exit;
+};
+
+static int
+io_next_chunk(clamma_io_t *io, io_chunk_t *ch)
+{
+	while (io->next < io->count && io->co >= io->r[io->next].len) {
+		io->next++;
+		io->co = 0;
+	}
+
+	if (io->next == io->count)
+		return 1;
+
+	ch->r = &io->r[io->next];
+	ch->co = io->co;
+	ch->len = ch->r->len - io->co;
+	if (ch->len > CLAMMA_IO_CHUNK)
+		ch->len = CLAMMA_IO_CHUNK;
+	io->co += ch->len;
+
+	return 0;
+}
+
+/*
+ * For O_DIRECT, the file offset and length must be aligned, so we read the
+ * aligned extent covering the chunk into a bounce slot
+ */
+
+static uint64_t
+io_direct_ofs(const io_chunk_t *ch)
+{
+	return (ch->r->ofs + ch->co) & ~((uint64_t)CLAMMA_IO_ALIGN - 1);
+}
+
+static size_t
+io_direct_len(const io_chunk_t *ch)
+{
+	uint64_t end = ch->r->ofs + ch->co + ch->len;
+
+	end = (end + CLAMMA_IO_ALIGN - 1) & ~((uint64_t)CLAMMA_IO_ALIGN - 1);
+
+	return (size_t)(end - io_direct_ofs(ch));
+}
+
+/*
+ * Account for a chunk read of res bytes (or -errno), copying it out of the
+ * bounce slot if it was a direct read
+ */
+
+static void
+io_chunk_done(clamma_io_t *io, const io_chunk_t *ch, const uint8_t *slot,
+	      ssize_t res)
+{
+	size_t skip;
+
+	if (res <= 0)
+		return;
+
+	if (io->fd_direct >= 0) {
+		skip = (size_t)(ch->r->ofs + ch->co - io_direct_ofs(ch));
+		if ((size_t)res <= skip)
+			return;
+		res -= (ssize_t)skip;
+		if ((size_t)res > ch->len)
+			res = (ssize_t)ch->len;
+		memcpy((uint8_t *)ch->r->buf + ch->co, slot + skip,
+		       (size_t)res);
+	}
+
+	ch->r->res += res;
+}
+
+static ssize_t
+io_chunk_pread(clamma_io_t *io, const io_chunk_t *ch, uint8_t *slot)
+{
+	if (io->fd_direct >= 0)
+		return pread(io->fd_direct, slot, io_direct_len(ch),
+			     (off_t)io_direct_ofs(ch));
+
+	return pread(io->fd, (uint8_t *)ch->r->buf + ch->co, ch->len,
+		     (off_t)(ch->r->ofs + ch->co));
+}
+
+static void *
+io_thread(void *d)
+{
+	io_reader_t *rd = (io_reader_t *)d;
+	clamma_io_t *io = rd->io;
+	uint8_t *slot = rd->slot;
+	io_chunk_t ch;
+	ssize_t res;
+
+	pthread_mutex_lock(&io->mut);
+
+	while (!io->exit) {
+		if (!io->r || io_next_chunk(io, &ch)) {
+			pthread_cond_wait(&io->cond_work, &io->mut);
+			continue;
+		}
+
+		pthread_mutex_unlock(&io->mut);
+		res = io_chunk_pread(io, &ch, slot);
+		pthread_mutex_lock(&io->mut);
+
+		io_chunk_done(io, &ch, slot, res);
+		if (!--io->pending)
+			pthread_cond_signal(&io->cond_done);
+	}
+
+	pthread_mutex_unlock(&io->mut);
+
+	return NULL;
+}
+
+/*
+ * Without io_uring, or after it failed, reads are done by reader threads with
+ * their own slots.  A thread is only started once its slot is allocated, so
+ * every thread we count can take chunks.  Returns 0 if we have at least one.
+ */
+
+static int
+io_threads_start(clamma_io_t *io)
+{
+	io_reader_t *rd;
+
+	free(io->slots);
+	io->slots = NULL;
+
+	while (io->count_threads < CLAMMA_IO_THREADS) {
+		rd = &io->reader[io->count_threads];
+		rd->io = io;
+
+		if (io->fd_direct >= 0 && posix_memalign((void **)&rd->slot,
+					CLAMMA_IO_ALIGN, CLAMMA_IO_SLOT))
+			break;
+
+		if (pthread_create(&rd->pt, NULL, io_thread, rd)) {
+			free(rd->slot);
+			rd->slot = NULL;
+			break;
+		}
+
+		io->count_threads++;
+	}
+
+	if (!io->count_threads)
+		fprintf(stderr, "%s: no reader threads\n", __func__);
+
+	return !io->count_threads;
+}
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+static int
+io_read_uring(clamma_io_t *io)
+{
+	unsigned int inflight = 0, s;
+	uint64_t user;
+	io_chunk_t ch;
+	int res, more;
+
+	more = !io_next_chunk(io, &ch);
+
+	while (more || inflight) {
+		for (s = 0; more && s < CLAMMA_IO_DEPTH; s++) {
+			if (io->inflight[s].r)
+				continue;
+
+			if (io->fd_direct >= 0) {
+				if (clamma_uring_queue_read(io->ring,
+					    io->fd_direct,
+					    io->slots + s * CLAMMA_IO_SLOT,
+					    io_direct_len(&ch),
+					    io_direct_ofs(&ch), (int)s, s))
+					break;
+			} else
+				if (clamma_uring_queue_read(io->ring, io->fd,
+					    (uint8_t *)ch.r->buf + ch.co,
+					    ch.len, ch.r->ofs + ch.co, -1, s))
+					break;
+
+			io->inflight[s] = ch;
+			inflight++;
+			more = !io_next_chunk(io, &ch);
+		}
+
+		if (clamma_uring_wait(io->ring, &user, &res)) {
+			/*
+			 * The ring is broken... let the kernel finish what it
+			 * has of ours, then give it up, the caller redoes the
+			 * batch without it
+			 */
+			fprintf(stderr, "%s: io_uring failed, using threads\n",
+					__func__);
+			clamma_uring_drain(io->ring, inflight);
+			clamma_uring_destroy(io->ring);
+			io->ring = NULL;
+			memset(io->inflight, 0, sizeof(io->inflight));
+
+			return 1;
+		}
+
+		s = (unsigned int)user;
+		io_chunk_done(io, &io->inflight[s], io->slots ?
+			      io->slots + s * CLAMMA_IO_SLOT : NULL, res);
+		io->inflight[s].r = NULL;
+		inflight--;
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * Read all count requests, filling in each one's res with how many bytes we
+ * got.  Only one thread may be reading a batch on a given io at a time.
+ */
+
+int
+clamma_io_read(clamma_io_t *io, clamma_io_req_t *r, unsigned int count)
+{
+	io_chunk_t ch;
+	unsigned int n;
+
+	for (n = 0; n < count; n++)
+		r[n].res = 0;
+
+	pthread_mutex_lock(&io->mut);
+
+	io->r = r;
+	io->count = count;
+	io->next = 0;
+	io->co = 0;
+	io->pending = 0;
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+	if (io->ring) {
+		n = (unsigned int)io_read_uring(io);
+		if (!n || io_threads_start(io)) {
+			io->r = NULL;
+			pthread_mutex_unlock(&io->mut);
+
+			return (int)n;
+		}
+
+		/* the ring failed and is gone, do the batch again with threads */
+
+		for (n = 0; n < count; n++)
+			r[n].res = 0;
+		io->next = 0;
+		io->co = 0;
+	}
+#endif
+
+	while (!io_next_chunk(io, &ch))
+		io->pending++;
+	io->next = 0;
+	io->co = 0;
+
+	if (io->pending) {
+		pthread_cond_broadcast(&io->cond_work);
+		while (io->pending)
+			pthread_cond_wait(&io->cond_done, &io->mut);
+	}
+
+	io->r = NULL;
+	pthread_mutex_unlock(&io->mut);
+
+	return 0;
+}
+
+/*
+ * A one-off read from any thread, for demand misses... these must also go
+ * around the page cache if we're doing direct io
+ */
+
+ssize_t
+clamma_io_pread(clamma_io_t *io, void *buf, size_t len, uint64_t ofs)
+{
+	clamma_io_req_t r = { buf, len, ofs, 0 };
+	uint8_t *slot;
+	io_chunk_t ch;
+
+	if (io->fd_direct < 0)
+		return pread(io->fd, buf, len, (off_t)ofs);
+
+	if (posix_memalign((void **)&slot, CLAMMA_IO_ALIGN, CLAMMA_IO_SLOT))
+		return -1;
+
+	ch.r = &r;
+	for (ch.co = 0; ch.co < len; ch.co += ch.len) {
+		ch.len = len - ch.co;
+		if (ch.len > CLAMMA_IO_CHUNK)
+			ch.len = CLAMMA_IO_CHUNK;
+		io_chunk_done(io, &ch, slot, io_chunk_pread(io, &ch, slot));
+		if (r.res != (ssize_t)(ch.co + ch.len))
+			break;
+	}
+
+	free(slot);
+
+	return r.res;
+}
+
+void
+clamma_io_destroy(clamma_io_t *io)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&io->mut);
+	io->exit = 1;
+	pthread_cond_broadcast(&io->cond_work);
+	pthread_mutex_unlock(&io->mut);
+
+	for (n = 0; n < io->count_threads; n++) {
+		pthread_join(io->reader[n].pt, NULL);
+		free(io->reader[n].slot);
+	}
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+	if (io->ring)
+		clamma_uring_destroy(io->ring);
+#endif
+	pthread_cond_destroy(&io->cond_done);
+	pthread_cond_destroy(&io->cond_work);
+	pthread_mutex_destroy(&io->mut);
+	free(io->slots);
+	free(io);
+}
+
+/*
+ * fd_direct is -1, or an O_DIRECT fd on the model to read from instead of fd
+ */
+
+clamma_io_t *
+clamma_io_create(int fd, int fd_direct)
+{
+#if defined(LIBCLAMMA_WITH_IO_URING)
+	struct iovec iov[CLAMMA_IO_DEPTH];
+	unsigned int n;
+#endif
+	clamma_io_t *io;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return NULL;
+
+	io->fd = fd;
+	io->fd_direct = fd_direct;
+	pthread_mutex_init(&io->mut, NULL);
+	pthread_cond_init(&io->cond_work, NULL);
+	pthread_cond_init(&io->cond_done, NULL);
+
+	if (fd_direct >= 0 && posix_memalign((void **)&io->slots,
+				CLAMMA_IO_ALIGN,
+				(size_t)CLAMMA_IO_DEPTH * CLAMMA_IO_SLOT))
+		goto bail;
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+	for (n = 0; io->slots && n < CLAMMA_IO_DEPTH; n++) {
+		iov[n].iov_base = io->slots + n * CLAMMA_IO_SLOT;
+		iov[n].iov_len = CLAMMA_IO_SLOT;
+	}
+
+	io->ring = clamma_uring_create(CLAMMA_IO_DEPTH, iov,
+				       io->slots ? CLAMMA_IO_DEPTH : 0);
+	if (io->ring)
+		return io;
+#endif
+
+	if (!io_threads_start(io))
+		return io;
+
+bail:
+	clamma_io_destroy(io);
+
+	return NULL;
+}
@@ -0,0 +1,223 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Mapping the model for CLAMMA_MODEL_ACCESS_MMAP, with the optional tuning
+ * from info.mmap_flags.  Most of it is only effective on Linux, elsewhere we
+ * just do the plain mmap().
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "private.h"
+
+#define CLAMMA_PREWARM_PAGE	4096
+
+/*
+ * The default hugetlbfs page size, which MAP_HUGETLB uses
+ */
+
+static size_t
+mmap_huge_page_size(void)
+{
+	size_t size = 2 * 1024 * 1024;
+#if defined(__linux__)
+	unsigned long kb;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return size;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = (size_t)kb * 1024;
+			break;
+		}
+
+	fclose(f);
+#endif
+
+	return size;
+}
+
+/*
+ * Read the model into anonymous memory backed by hugetlbfs pages if there are
+ * enough reserved, else by transparent hugepages if the kernel will give us
+ * them.  Either way a token's sweep through the weights takes a fraction of
+ * the TLB misses of 4KB pages.
+ */
+
+static int
+mmap_huge_copy(txf_t *t)
+{
+#if defined(__linux__) && defined(MAP_HUGETLB)
+	size_t hps = mmap_huge_page_size(), size, done = 0;
+	const char *kind = "hugetlbfs";
+	ssize_t n;
+	void *p;
+
+	size = ((size_t)t->file_size + hps - 1) & ~(hps - 1);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return 1;
+		kind = "THP";
+		madvise(p, size, MADV_HUGEPAGE);
+	}
+
+	clamma_numa_bind(t, p, size);
+
+	while (done < (size_t)t->file_size) {
+		n = pread(t->fd, (uint8_t *)p + done,
+			  (size_t)t->file_size - done, (off_t)done);
+		if (n <= 0) {
+			munmap(p, size);
+			return 1;
+		}
+		done += (size_t)n;
+	}
+
+	mprotect(p, size, PROT_READ);
+	t->data = p;
+	t->map_size = size;
+
+	fprintf(stderr, "%s: model copied to %s pages\n", __func__, kind);
+
+	return 0;
+#else
+	(void)t;
+
+	return 1;
+#endif
+}
+
+#if defined(LIBCLAMMA_SMP)
+
+/*
+ * Touch a byte in each page from the start of the model, so the first tokens
+ * don't stall faulting it in a page at a time, without holding up the
+ * construct like MAP_POPULATE
+ */
+
+static void *
+mmap_prewarm_thread(void *d)
+{
+	txf_t *t = (txf_t *)d;
+	const volatile uint8_t *p = (const uint8_t *)t->data;
+	size_t ofs;
+	uint8_t sum = 0;
+
+	for (ofs = 0; ofs < (size_t)t->file_size;
+	     ofs += CLAMMA_PREWARM_PAGE) {
+		if (!(ofs & ((256 * CLAMMA_PREWARM_PAGE) - 1)) &&
+		    atomic_load_explicit(&t->prewarm_stop,
+					 memory_order_relaxed))
+			break;
+		sum = (uint8_t)(sum + p[ofs]);
+	}
+
+	(void)sum;
+
+	return NULL;
+}
+#endif
+
+int
+clamma_mmap_model(txf_t *t, unsigned int flags)
+{
+	int mf = MAP_PRIVATE;
+
+	t->map_size = (size_t)t->file_size;
+
+	if ((flags & CLAMMA_MMAP_HUGETLB_COPY) && !mmap_huge_copy(t)) {
+		/* it's all resident already */
+		flags &= ~(unsigned int)CLAMMA_MMAP_PREWARM;
+		goto mapped;
+	}
+
+#if defined(MAP_POPULATE)
+	if (flags & CLAMMA_MMAP_POPULATE)
+		mf |= MAP_POPULATE;
+#endif
+
+	t->data = mmap(NULL, t->map_size, PROT_READ, mf, t->fd, 0);
+	if (t->data == MAP_FAILED)
+		return 1;
+
+	/*
+	 * No clamma_numa_bind() here... the pages of a file mapping we only
+	 * read are the page cache's, shared with everyone, and a policy on
+	 * our mapping doesn't move or place them.  Use HUGETLB_COPY or
+	 * numa_replicate to get the model into memory we can place.
+	 */
+
+#if defined(__linux__)
+	if ((flags & CLAMMA_MMAP_WILLNEED) &&
+	    madvise(t->data, t->map_size, MADV_WILLNEED))
+		fprintf(stderr, "%s: MADV_WILLNEED failed\n", __func__);
+	if ((flags & CLAMMA_MMAP_SEQUENTIAL) &&
+	    madvise(t->data, t->map_size, MADV_SEQUENTIAL))
+		fprintf(stderr, "%s: MADV_SEQUENTIAL failed\n", __func__);
+	if ((flags & CLAMMA_MMAP_HUGEPAGE) &&
+	    madvise(t->data, t->map_size, MADV_HUGEPAGE))
+		/* file THP needs CONFIG_READ_ONLY_THP_FOR_FS */
+		fprintf(stderr, "%s: MADV_HUGEPAGE failed\n", __func__);
+#endif
+
+mapped:
+	if ((flags & CLAMMA_MMAP_MLOCK) && mlock(t->data, t->map_size))
+		fprintf(stderr, "%s: mlock failed (RLIMIT_MEMLOCK?), errno %d\n",
+				__func__, errno);
+
+#if defined(LIBCLAMMA_SMP)
+	atomic_init(&t->prewarm_stop, 0);
+	if ((flags & CLAMMA_MMAP_PREWARM) &&
+	    !pthread_create(&t->pt_prewarm, NULL, mmap_prewarm_thread, t))
+		t->prewarm_running = 1;
+#endif
+
+	return 0;
+}
+
+void
+clamma_mmap_unmap(txf_t *t)
+{
+#if defined(LIBCLAMMA_SMP)
+	if (t->prewarm_running) {
+		atomic_store(&t->prewarm_stop, 1);
+		pthread_join(t->pt_prewarm, NULL);
+		t->prewarm_running = 0;
+	}
+#endif
+
+	if (t->data != MAP_FAILED)
+		munmap(t->data, t->map_size);
+}
@@ -0,0 +1,358 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * CPU affinity and NUMA memory placement.  These are only effective on Linux,
+ * where we use the raw syscalls so there's no dependency on libnuma.
+ * Elsewhere the cpu list is still parsed, but pinning and placement do
+ * nothing.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "private.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+/*
+ * Parse a cpu list like "0-3,8,10-11" into a cpu set.  Returns 0 if OK, or
+ * nonzero if the list is malformed or names cpus we can't represent.
+ */
+
+int
+clamma_cpuset_parse(clamma_cpuset_t *cs, const char *list)
+{
+	unsigned long a, b;
+	char *end;
+
+	memset(cs, 0, sizeof(*cs));
+
+	while (list && *list) {
+		a = strtoul(list, &end, 10);
+		if (end == list)
+			return 1;
+		b = a;
+		list = end;
+		if (*list == '-') {
+			b = strtoul(++list, &end, 10);
+			if (end == list || b < a)
+				return 1;
+			list = end;
+		}
+		if (b >= CLAMMA_MAX_CPUS)
+			return 1;
+
+		while (a <= b) {
+			cs->b[a / 64] |= 1ull << (a % 64);
+			a++;
+		}
+
+		if (*list == ',')
+			list++;
+		else if (*list)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the nth cpu in the set, wrapping around if the set has fewer than n
+ * cpus, or -1 if the set is empty
+ */
+
+int
+clamma_cpuset_nth(const clamma_cpuset_t *cs, unsigned int n)
+{
+	unsigned int count = 0, c;
+
+	for (c = 0; c < CLAMMA_MAX_CPUS; c++)
+		count += !!(cs->b[c / 64] & (1ull << (c % 64)));
+
+	if (!count)
+		return -1;
+
+	n %= count;
+	for (c = 0; c < CLAMMA_MAX_CPUS; c++)
+		if ((cs->b[c / 64] & (1ull << (c % 64))) && !n--)
+			break;
+
+	return (int)c;
+}
+
+/*
+ * Bitmap of the NUMA nodes the cpus in the set belong to, or of all nodes if
+ * the set is empty
+ */
+
+unsigned long
+clamma_numa_nodes(const clamma_cpuset_t *cs)
+{
+	unsigned long nodes = 0;
+#if defined(__linux__)
+	char path[96];
+	int c, n, empty = clamma_cpuset_nth(cs, 0) < 0;
+
+	for (n = 0; n < (int)(sizeof(nodes) * 8); n++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+			 n);
+		if (access(path, F_OK))
+			continue;
+		if (empty) {
+			nodes |= 1ul << n;
+			continue;
+		}
+		for (c = 0; c < CLAMMA_MAX_CPUS; c++) {
+			if (!(cs->b[c / 64] & (1ull << (c % 64))))
+				continue;
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/node%d", c, n);
+			if (!access(path, F_OK)) {
+				nodes |= 1ul << n;
+				break;
+			}
+		}
+	}
+#else
+	(void)cs;
+#endif
+
+	return nodes;
+}
+
+#if defined(__linux__)
+static int
+numa_mode(clamma_numa_t numa)
+{
+	switch (numa) {
+	case CLAMMA_NUMA_BIND:
+		return MPOL_BIND;
+	case CLAMMA_NUMA_INTERLEAVE:
+		return MPOL_INTERLEAVE;
+	default:
+		return MPOL_DEFAULT;
+	}
+}
+#endif
+
+/*
+ * Pin the calling thread to the cpus in pin, if any, and set its memory
+ * policy, so memory it faults in first, like pages of an mmapped model, is
+ * placed to match
+ */
+
+void
+clamma_thread_placement(const clamma_cpuset_t *pin, clamma_numa_t numa,
+			unsigned long nodes)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	int c, any = 0;
+
+	CPU_ZERO(&set);
+	for (c = 0; c < CLAMMA_MAX_CPUS && c < CPU_SETSIZE; c++)
+		if (pin->b[c / 64] & (1ull << (c % 64))) {
+			CPU_SET(c, &set);
+			any = 1;
+		}
+
+	if (any && sched_setaffinity(0, sizeof(set), &set))
+		fprintf(stderr, "%s: unable to pin to cpu %d\n", __func__,
+				clamma_cpuset_nth(pin, 0));
+
+	if (numa != CLAMMA_NUMA_DEFAULT && nodes &&
+	    syscall(SYS_set_mempolicy, numa_mode(numa), &nodes,
+		    sizeof(nodes) * 8 + 1))
+		fprintf(stderr, "%s: set_mempolicy failed %d\n",
+				__func__, errno);
+#else
+	(void)pin;
+	(void)numa;
+	(void)nodes;
+#endif
+}
+
+/*
+ * The NUMA node a cpu belongs to, or -1 if unknown
+ */
+
+int
+clamma_cpu_node(int cpu)
+{
+#if defined(__linux__)
+	char path[96];
+	int n;
+
+	for (n = 0; cpu >= 0 && n < CLAMMA_MAX_NODES; n++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/node%d", cpu, n);
+		if (!access(path, F_OK))
+			return n;
+	}
+#else
+	(void)cpu;
+#endif
+
+	return -1;
+}
+
+/*
+ * The nth node in a node bitmap, wrapping around, or -1 if it's empty
+ */
+
+int
+clamma_numa_nth_node(unsigned long nodes, unsigned int n)
+{
+	int count = __builtin_popcountl(nodes), b;
+
+	if (!count)
+		return -1;
+
+	n %= (unsigned int)count;
+	for (b = 0; b < CLAMMA_MAX_NODES; b++)
+		if ((nodes & (1ul << b)) && !n--)
+			break;
+
+	return b;
+}
+
+/*
+ * Fill cs with the cpus on a NUMA node, returns 0 if OK
+ */
+
+int
+clamma_node_cpus(int node, clamma_cpuset_t *cs)
+{
+	char path[96], list[512];
+	ssize_t n;
+	int fd;
+
+	memset(cs, 0, sizeof(*cs));
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	n = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+
+	while (n && (list[n - 1] == '\n' || list[n - 1] == ' '))
+		n--;
+	list[n] = '\0';
+
+	return clamma_cpuset_parse(cs, list);
+}
+
+/*
+ * Apply the transformer's NUMA policy to the whole pages inside a buffer,
+ * before they're touched
+ */
+
+void
+clamma_numa_bind(const txf_t *t, void *p, size_t len)
+{
+#if defined(__linux__)
+	uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE),
+		  s = ((uintptr_t)p + pg - 1) & ~(pg - 1),
+		  e = ((uintptr_t)p + len) & ~(pg - 1);
+
+	if (t->numa == CLAMMA_NUMA_DEFAULT || !t->numa_nodes || e <= s)
+		return;
+
+	if (syscall(SYS_mbind, (void *)s, e - s, numa_mode(t->numa),
+		    &t->numa_nodes, sizeof(t->numa_nodes) * 8 + 1, 0))
+		fprintf(stderr, "%s: mbind failed %d\n", __func__, errno);
+#else
+	(void)t;
+	(void)p;
+	(void)len;
+#endif
+}
+
+/*
+ * Make a copy of the model on each node in the transformer's node set, using
+ * memory bound to that node, so workers on the node can read their matmul
+ * weights locally.  Nodes we can't make a replica for just use the original.
+ */
+
+void
+clamma_numa_replicate(txf_t *t)
+{
+#if defined(__linux__)
+	unsigned long mask;
+	int n, count = 0;
+	void *p;
+
+	if (__builtin_popcountl(t->numa_nodes) < 2)
+		return;
+
+	for (n = 0; n < CLAMMA_MAX_NODES; n++) {
+		if (!(t->numa_nodes & (1ul << n)))
+			continue;
+
+		p = mmap(NULL, (size_t)t->file_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			continue;
+
+		mask = 1ul << n;
+		if (syscall(SYS_mbind, p, (size_t)t->file_size, MPOL_BIND,
+			    &mask, sizeof(mask) * 8 + 1, 0)) {
+			munmap(p, (size_t)t->file_size);
+			continue;
+		}
+
+		memcpy(p, t->data, (size_t)t->file_size);
+		mprotect(p, (size_t)t->file_size, PROT_READ);
+		t->replica[n] = p;
+		count++;
+	}
+
+	fprintf(stderr, "%s: model replicated on %d NUMA nodes\n", __func__,
+			count);
+#else
+	(void)t;
+#endif
+}
+
+void
+clamma_numa_replicas_free(txf_t *t)
+{
+	int n;
+
+	for (n = 0; n < CLAMMA_MAX_NODES; n++)
+		if (t->replica[n]) {
+			munmap(t->replica[n], (size_t)t->file_size);
+			t->replica[n] = NULL;
+		}
+}
@@ -47,6 +47,15 @@
 #include <sys/mman.h>
 #endif
 
+#if defined(LIBCLAMMA_SMP)
+#include <stdatomic.h>
+
+#define SMP_TSS_PARKED		(1 << 30)
+
+/* report work stealing and the tail latency of each batch of smp jobs */
+// #define SMP_SHOW_TAIL_LATENCY
+#endif
+
 #include "clamma.h"
 
 /*
@@ -60,6 +69,26 @@ enum {
 
 typedef int8_t cq_t;
 
+#define clamma_container_of(P, T, M) ((T *)((char *)(P) - offsetof(T, M)))
+
+/*
+ * Intrusive doubly-linked list, the owner tracks head, tail and count
+ */
+
+struct clamma_dll2_owner;
+
+typedef struct clamma_dll2 {
+	struct clamma_dll2		*prev;
+	struct clamma_dll2		*next;
+	struct clamma_dll2_owner	*owner;
+} clamma_dll2_t;
+
+typedef struct clamma_dll2_owner {
+	clamma_dll2_t		*head;
+	clamma_dll2_t		*tail;
+	uint32_t		count;
+} clamma_dll2_owner_t;
+
 typedef struct {
 	uint32_t	dim; /* model dimensions */
 	uint32_t	hidden_dim; /* for ffn layers */
@@ -84,6 +113,7 @@ typedef struct {
 
 typedef struct {
 	qt_t		*q_tokens; // (size, dim)
+	/* float models only, int8 rows are dequantized per token */
 	float		*token_embedding_table;    // (vocab_size, dim)
 	// weights for neur_rmsnorms
 	float		*rms_att_weight; // (layer, dim) neur_rmsnorm weights
@@ -132,7 +162,11 @@ typedef struct {
 
 #if defined(LIBCLAMMA_SMP)
 	clamma_sem_t	sem_done;
-	int		queued;
+	atomic_int	queued; /* our jobs not yet completed by workers, and
+				 * SMP_TSS_PARKED if we're waiting on sem_done */
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	atomic_ullong	first_done; /* when the batch's first job completed */
+#endif
 #endif
 } txf_session_state_t;
 
@@ -150,25 +184,93 @@ typedef struct {
 	txf_session_state_t tss;
 } txf_state_t;
 
+/*
+ * The weight cache holds the model in aligned CWC_BLOCK_SIZE blocks, so reads
+ * of any range share whatever blocks they overlap.  Entries are found by
+ * hashing their offset in the model, and are also on an LRU list with the
+ * least recently used at the head.  A cursor keeps the block it's reading
+ * pinned, and pinned entries can't be evicted.
+ *
+ * Optionally, evicted blocks are kept compressed in a second tier with its own
+ * limit, hash and LRU list, so a miss there can be decompressed instead of
+ * read from the file.  Compressed entries stay until they're evicted from
+ * that tier, so blocks going round between the tiers are compressed once.
+ */
+
+#define CWC_BLOCK_SIZE		(128 * 1024)
+#define CWC_HASH_BITS		14
+
 typedef struct cwc {
-	struct cwc	*next;
-	uint64_t	offset;
-	size_t		len;
+	clamma_dll2_t	lru;
+	struct cwc	*hnext; /* next in our hash bucket */
+	uint64_t	offset; /* of the block in the model */
+	size_t		len; /* CWC_BLOCK_SIZE, or less at the end */
 	unsigned int	count;
+	unsigned int	pins; /* users still reading our data */
+	char		filling; /* being read in without the lock held */
+	char		failed; /* the read failed, unlinked and freed on unpin */
 } cwc_t;
 
+typedef struct cwcz {
+	clamma_dll2_t	lru;
+	struct cwcz	*hnext; /* next in our hash bucket */
+	uint64_t	offset; /* of the block in the model */
+	size_t		len; /* of the block decompressed */
+	size_t		zlen; /* of the compressed data following us */
+	unsigned int	pins; /* users decompressing our data */
+} cwcz_t;
+
 typedef struct cwc_state {
-	cwc_t		*cwc_head;
+	cwc_t		*hash[1 << CWC_HASH_BITS];
+	clamma_dll2_owner_t lru;
+	cwcz_t		*zhash[1 << CWC_HASH_BITS]; /* compressed tier */
+	clamma_dll2_owner_t zlru;
+	cwc_t		*victims; /* evicted, waiting to be compressed */
+	unsigned int	zinserts;
+	unsigned int	inserts;
 	int		cwc_created;
 	uint64_t	cwc_fetched;
 	uint64_t	cwc_touched;
 	uint64_t	cwc_alloced;
-
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	uint64_t	prefetched;
+	uint64_t	stall_ns; /* forwards waiting on reads into the cache */
+	uint64_t	z_alloced;
+	uint64_t	z_hits;
+	uint64_t	z_stored;
+	uint64_t	z_rejected; /* didn't compress enough to keep */
+
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
+	clamma_mutex_t	mut_cwc;
+#endif
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_t mut_cwc;
+	clamma_cond_t	cond_fill; /* signalled when an entry fill completes */
+
+	struct clamma_io *io; /* batched reader for the prefetch thread */
+	clamma_thread_t	pt_prefetch;
+	clamma_cond_t	cond_prefetch; /* signalled on a new prefetch request */
+	int		prefetch_unit; /* unit wanted next, or -1 */
+	char		prefetch_running;
+	char		prefetch_exit;
 #endif
 } cwc_state_t;
 
+/*
+ * Optional cache of dequantized int8 token embedding rows, direct-mapped by
+ * token id... prompts and chat templates reuse a few tokens a lot
+ */
+
+typedef struct emb_cache {
+	float		*rows; /* count rows of dim floats */
+	tok_id_t	*tag; /* token held in each row, or -1 */
+	unsigned int	count;
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
+	clamma_mutex_t	mut;
+#endif
+} emb_cache_t;
+
 typedef struct {
 	float		prob;
 	int		index;
@@ -182,15 +284,32 @@ typedef struct txf_sampler {
 	uint64_t	rng_state;
 } txf_sampler_t;
 
+/*
+ * Where a session is in its lifecycle... sessions with an active query live on
+ * the run queue for their state, idle sessions and sessions being stepped at
+ * the moment aren't on any run queue.
+ */
+
+typedef enum {
+	CLAMMA_SESS_IDLE,	/* no query active */
+	CLAMMA_SESS_WAITING,	/* query waiting for memory budget */
+	CLAMMA_SESS_PREFILL,	/* still consuming prompt tokens */
+	CLAMMA_SESS_DECODE,	/* generating new tokens */
+	CLAMMA_SESS_FINISHED,	/* cancelled, waiting to be reaped */
+} clamma_sess_state_t;
+
 typedef struct txf_session {
 	const struct txf *t;
-	struct txf_session *next;
+	clamma_dll2_t	list; /* on the run queue for our state, if any */
+	clamma_sess_state_t state;
 
 	txf_state_t	s;
 	txf_sampler_t   sampler;
 
 	size_t		pos;
 	size_t		limit;
+	size_t		kv_len; /* positions the kv cache is sized for */
+	size_t		kv_reserved; /* bytes reserved against mem_budget */
 	size_t		ct;
 	tok_id_t	token;
 	tok_id_t	tnext;
@@ -201,7 +320,16 @@ typedef struct txf_session {
 	issue_cb_t	issue_cb;
 	void		*opaque_user_pointer;
 	void		**null_on_destroy;
+	char		utf8[16]; /* for <0xAB[CD]> format conversion */
 	char		client_gone;
+	char		pooled; /* preallocated, returns to txf pool_free */
+
+	/* for sessions stepped by the engine thread, protected by its mutex */
+	clamma_dll2_t	ready; /* on the engine's list of undrained sessions */
+	char		*pend; /* output buffered for clamma_engine_drain() */
+	size_t		pend_len;
+	size_t		pend_alloc;
+	char		engine;
 } txf_session_t;
 
 typedef struct tidx {
@@ -216,9 +344,15 @@ typedef struct vocab {
 	size_t		size;
 	size_t		storage_size;
 	uint32_t	max_token_length;
-	char		utf8[16]; /* for <0xAB[CD]> format conversion */
 } txf_vocab_t;
 
+#define CLAMMA_MAX_CPUS 1024
+#define CLAMMA_MAX_NODES 64 /* bits in an unsigned long node bitmap */
+
+typedef struct clamma_cpuset {
+	uint64_t	b[CLAMMA_MAX_CPUS / 64];
+} clamma_cpuset_t;
+
 typedef struct txf {
 	txf_config_t	c;
 	txf_weights_t	w;
@@ -229,24 +363,64 @@ typedef struct txf {
 	void		*model_base;
 	size_t		model_size;
 	size_t		cache_limit;
+	size_t		cache_zlimit; /* compressed tier, 0 if none */
+	cwc_state_t	cwc; /* our weight cache, if MALLOC_CACHE */
+	emb_cache_t	emb; /* hot int8 embedding rows, if any */
 
 	unsigned int	max_sessions;
+	uint64_t	spin_ns; /* spin this long on smp sync before sleeping */
+	clamma_numa_t	numa;
+	unsigned long	numa_nodes; /* bitmap of nodes for numa policy */
+	char		numa_replicate;
+	struct clamma_pool *pool; /* smp worker threads we use */
+#if defined(LIBCLAMMA_WITH_OPENMP)
+	int		omp_threads; /* size of the OpenMP team we use */
+#endif
+	/* NULL, or copies of the model in memory local to each node */
+	uint8_t		*replica[CLAMMA_MAX_NODES];
+	/* these are protected by mut_sessions */
+	unsigned int	count_sessions;
+	size_t		mem_budget;
+	size_t		mem_reserved;
+	clamma_dll2_owner_t mem_waiting; /* queries waiting for memory */
+	clamma_dll2_owner_t pool_free; /* preallocated sessions not in use */
+	size_t		pool_reserved; /* held by the pool for the txf lifetime */
+	unsigned int	count_pooled; /* sessions the pool was created with */
+
 	char		name[33];
 	struct txf	*next;
 
 	int		fd;
+	int		fd_direct; /* -1, or O_DIRECT fd for the weight cache */
 	float		*data;
+	size_t		map_size; /* length of the mapping at data, if MMAP */
+#if defined(LIBCLAMMA_SMP)
+	clamma_thread_t	pt_prewarm;
+	atomic_int	prewarm_stop;
+	char		prewarm_running;
+#endif
 	unsigned int	d_ofs;
 	ssize_t		file_size;
 } txf_t;
 
+int
+clamma_txf_embedding(const txf_t *t, float *x, tok_id_t token);
+
 int
 _session_matmul(txf_session_state_t *tss,    float *xout, const float *x,
-		const float *w1, int i, int dlim, int n, int d);
+		const float *w1, int i, int dlim, int n);
 
 int
 _session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
-		   const qt_t *w1, int i, int dlim, int n, int d);
+		   const qt_t *w1, int i, int dlim, int n);
+
+void
+clamma_matmul_rows(float *xout, const float *x, const float *w, int i,
+		   int dlim, int n);
+
+void
+clamma_matmul_qt_rows(float *xout, const qt_t *x, const cq_t *w_q,
+		      const float *w_s, unsigned int gs, int i, int dlim, int n);
 
 #if defined(LIBCLAMMA_SMP)
 
@@ -270,33 +444,95 @@ typedef struct job {
 	int			dlim;
 } job_t;
 
-typedef struct work {
-	clamma_mutex_t mut_job;
+#if LIBCLAMMA_MAX_THREAD_JOB_QUEUE & (LIBCLAMMA_MAX_THREAD_JOB_QUEUE - 1)
+#error "LIBCLAMMA_MAX_THREAD_JOB_QUEUE must be a power of two"
+#endif
+
+/*
+ * Bounded lock-free MPMC job ring.  Each cell has a sequence number that says
+ * whether it's ready to be written for a given lap of job_head, or ready to be
+ * read for a given lap of job_tail, so producers and consumers only contend on
+ * the head or tail index with a compare-and-swap.
+ *
+ * Each worker has its own ring that producers spread tasks across, a worker
+ * takes from its own ring first and steals from the others when it's empty.
+ */
+
+typedef struct job_cell {
+	atomic_size_t	seq;
+	job_t		job;
+} job_cell_t;
 
-	job_t		job_ring[LIBCLAMMA_MAX_THREAD_JOB_QUEUE];
+typedef struct job_ring {
+	job_cell_t	job_ring[LIBCLAMMA_MAX_THREAD_JOB_QUEUE];
 
-	int		job_head;
-	int		job_tail;
-} work_t;
+	/* keep producers and consumers off each other's cacheline */
+	_Alignas(64) atomic_size_t job_head;
+	_Alignas(64) atomic_size_t job_tail;
+} job_ring_t;
+
+/*
+ * A pool of worker threads and their job rings.  Each transformer has its own
+ * pool, or attaches to a named pool shared with other transformers.
+ */
+
+typedef struct clamma_pool {
+	struct clamma_pool	*next; /* on the list of named pools */
+	struct work_threads	*work_threads;
+	unsigned int		count_threads;
+	unsigned int		refcount; /* transformers using the pool */
+
+	/* bumped whenever jobs are queued, so idle workers can spin on it */
+	_Alignas(64) atomic_int	gen;
+	/* the worker ring the next task is queued on */
+	atomic_uint		rr;
+
+	/* cost model, calibrated when the pool is created */
+	uint64_t		handoff_ns; /* queue to the workers and sync */
+	unsigned int		mac_ps[2]; /* ps per multiply-add, by job type */
+	size_t			tile_bytes; /* weights per task to sit in L2 */
+
+	char			name[32];
+} clamma_pool_t;
 
 typedef struct work_threads {
+	job_ring_t	ring;
+
+	clamma_pool_t	*pool;
 	pthread_t	pt;
 	clamma_sem_t	sem_start;
+	atomic_int	parked; /* waiting on sem_start */
 	char		running;
-	char		exiting;
+	atomic_char	exiting;
+	clamma_cpuset_t	pin; /* empty, or cpus to pin to */
+	int		node; /* -1, or NUMA node we're pinned to */
+	clamma_numa_t	numa;
+	unsigned long	numa_nodes;
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	uint64_t	steals;
+#endif
 } work_threads_t;
 
-
-extern work_threads_t *work_threads;
-extern work_t work;
-extern unsigned int count_threads, thread_init_refcount;
 extern clamma_mutex_t          mut_sessions;
 
 void
-clamma_smp_deinit(void);
+clamma_smp_deinit(txf_t *t);
+
+int
+clamma_smp_init(txf_t *t, unsigned int threads, const clamma_cpuset_t *cs,
+		const char *pool_name);
+
+void
+clamma_job_ring_init(job_ring_t *r);
+
+void
+clamma_job_enqueue(job_ring_t *r, const job_t *j);
 
 int
-clamma_smp_init(unsigned int threads);
+clamma_job_dequeue(job_ring_t *r, job_t *j);
+
+void
+clamma_smp_calibrate(clamma_pool_t *p, const txf_t *t);
 
 int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x,
@@ -309,6 +545,9 @@ session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x, const qt
 void
 clamma_smp_sync_point(txf_session_state_t *tss);
 
+void
+clamma_smp_help(txf_session_state_t *tss);
+
 int
 clamma_smp_tss_init(txf_session_state_t *tss);
 
@@ -318,39 +557,67 @@ clamma_smp_tss_deinit(txf_session_state_t *tss);
 void *
 clamma_session_worker(void *tp);
 
+#else
+#if defined(LIBCLAMMA_WITH_OPENMP)
+
+extern clamma_mutex_t          mut_sessions;
+
+/*
+ * The OpenMP versions in smp-openmp.c do the whole matmul in a parallel region
+ * before returning, so there's nothing left to wait for at the sync points
+ */
+
+int
+session_matmul(txf_session_state_t *tss, float *xout, const float *x,
+	       const float *w1, int n, int d);
+
+int
+session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x, const qt_t *w,
+		int n, int d);
+
+int
+clamma_smp_init(txf_t *t, unsigned int threads, const clamma_cpuset_t *cs,
+		const char *pool_name);
+
 #else
 static inline int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x, const float *w1,
 		int n, int d)
 {
-	return _session_matmul(tss, xout, x, w1, 0, d, n, d);
+	return _session_matmul(tss, xout, x, w1, 0, d, n);
 }
 
 static inline int
 session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x, const qt_t *w,
 		  int n, int d)
 {
-	return _session_matmul_qt(tss, xout, x, w, 0, d, n, d);
+	return _session_matmul_qt(tss, xout, x, w, 0, d, n);
 }
 
-static inline void
-clamma_smp_sync_point(txf_session_state_t *tss)
+static inline int
+clamma_smp_init(txf_t *t, unsigned int threads, const clamma_cpuset_t *cs,
+		const char *pool_name)
 {
-	(void)tss;
+	(void)t;
+	(void)threads;
+	(void)cs;
+	(void)pool_name;
 	do { } while(0);
+	return 0;
 }
+#endif
 
-static inline int
-clamma_smp_init(unsigned int threads)
+static inline void
+clamma_smp_sync_point(txf_session_state_t *tss)
 {
-	(void)threads;
+	(void)tss;
 	do { } while(0);
-	return 0;
 }
 
 static inline void
-clamma_smp_deinit(void)
+clamma_smp_deinit(txf_t *t)
 {
+	(void)t;
 	do { } while(0);
 }
 
@@ -370,14 +637,110 @@ clamma_smp_tss_deinit(txf_session_state_t *tss)
 }
 #endif
 
+void
+clamma_dll2_add_head(clamma_dll2_t *d, clamma_dll2_owner_t *owner);
+
+void
+clamma_dll2_add_tail(clamma_dll2_t *d, clamma_dll2_owner_t *owner);
+
+void
+clamma_dll2_remove(clamma_dll2_t *d);
+
+clamma_dll2_t *
+clamma_dll2_pop_head(clamma_dll2_owner_t *owner);
+
 void
 session_softmax(float *x, int size);
 
+typedef struct {
+	const txf_t	*t;
+	const uint8_t	*pin; /* data of the block we have pinned, or NULL */
+	uint64_t	ofs; /* of the pinned block in the model */
+	size_t		touched; /* bytes served from the pinned block */
+} cwc_cursor_t;
+
 const void *
-clamma_weight_cache(const txf_t *t, const void *weight, size_t size);
+clamma_weight_span(cwc_cursor_t *cur, const void *weight, size_t len,
+		   size_t *avail);
+
+void
+clamma_weight_span_done(cwc_cursor_t *cur);
+
+int
+clamma_weight_read(const txf_t *t, void *dst, const void *weight, size_t len);
+
+void
+clamma_weight_cache_init(txf_t *t);
+
+void
+clamma_weight_cache_deinit(txf_t *t);
+
+#if defined(LIBCLAMMA_SMP)
+typedef struct clamma_io_req {
+	void		*buf;
+	size_t		len;
+	uint64_t	ofs;
+	ssize_t		res; /* bytes read */
+} clamma_io_req_t;
+
+typedef struct clamma_io clamma_io_t;
+
+clamma_io_t *
+clamma_io_create(int fd, int fd_direct);
+
+void
+clamma_io_destroy(clamma_io_t *io);
+
+int
+clamma_io_read(clamma_io_t *io, clamma_io_req_t *r, unsigned int count);
+
+ssize_t
+clamma_io_pread(clamma_io_t *io, void *buf, size_t len, uint64_t ofs);
+
+#if defined(LIBCLAMMA_WITH_IO_URING)
+struct iovec;
+typedef struct clamma_uring clamma_uring_t;
+
+clamma_uring_t *
+clamma_uring_create(unsigned int depth, const struct iovec *fixed,
+		    unsigned int count_fixed);
+
+void
+clamma_uring_destroy(clamma_uring_t *u);
+
+int
+clamma_uring_queue_read(clamma_uring_t *u, int fd, void *buf, size_t len,
+			uint64_t ofs, int fixed, uint64_t user);
+
+int
+clamma_uring_wait(clamma_uring_t *u, uint64_t *user, int *res);
+
+void
+clamma_uring_drain(clamma_uring_t *u, unsigned int inflight);
+#endif
+#endif
+
+size_t
+clamma_wz_compress(const uint8_t *in, size_t len, uint8_t *out,
+		   size_t out_max);
+
+int
+clamma_wz_decompress(const uint8_t *in, size_t zlen, uint8_t *out, size_t len);
+
+int
+clamma_mmap_model(txf_t *t, unsigned int flags);
+
+void
+clamma_mmap_unmap(txf_t *t);
 
 void
-clamma_weight_cache_clear(void);
+clamma_weight_prefetch(const txf_t *t, unsigned int unit);
+
+void
+clamma_weight_prefetch_start(txf_t *t);
+
+void
+clamma_weight_prefetch_stop(txf_t *t);
 
 int
 clamma_sampler_sample(txf_sampler_t *sampler, float *logits);
@@ -396,7 +759,26 @@ clamma_vocab_encode(const struct txf *t, const char *text, int8_t bos, int8_t eo
 		    size_t *n_tokens);
 
 const char *
-clamma_vocab_decode(const struct txf *t, int prev_token, int token);
+clamma_vocab_decode(const struct txf *t, int prev_token, int token,
+		    char *utf8);
+
+size_t
+clamma_session_kv_size(const struct txf *t, size_t positions);
+
+int
+clamma_sessions_run_one(int engine);
+
+int
+_session_query(txf_session_t *ts, const clamma_txf_info_t *info, char engine);
+
+void
+clamma_engine_kick(void);
+
+int
+clamma_engine_buffer(txf_session_t *ts, const char *piece);
+
+void
+clamma_engine_session_gone(txf_session_t *ts);
 
 tok_id_t
 clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos);
@@ -404,4 +786,63 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos);
 uint64_t
 clamma_timestamp_ns(void);
 
+int
+clamma_cpuset_parse(clamma_cpuset_t *cs, const char *list);
+
+int
+clamma_cpuset_nth(const clamma_cpuset_t *cs, unsigned int n);
+
+unsigned long
+clamma_numa_nodes(const clamma_cpuset_t *cs);
+
+void
+clamma_thread_placement(const clamma_cpuset_t *pin, clamma_numa_t numa,
+			unsigned long nodes);
+
+int
+clamma_cpu_node(int cpu);
+
+int
+clamma_numa_nth_node(unsigned long nodes, unsigned int n);
+
+int
+clamma_node_cpus(int node, clamma_cpuset_t *cs);
+
+void
+clamma_numa_replicate(txf_t *t);
+
+void
+clamma_numa_replicas_free(txf_t *t);
+
+void
+clamma_numa_bind(const txf_t *t, void *p, size_t len);
+
+#if defined(LIBCLAMMA_SMP)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define clamma_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define clamma_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define clamma_cpu_relax()
+#endif
+
+/*
+ * For spin-waits, returns nonzero while we are still inside the spin budget
+ * ending at until.  The clock is only read every 64 spins.
+ */
+
+static inline int
+clamma_spin_more(uint64_t until, unsigned int *n)
+{
+	clamma_cpu_relax();
+
+	if (++(*n) & 63)
+		return 1;
+
+	return clamma_timestamp_ns() < until;
+}
+
+#endif
+
 #endif
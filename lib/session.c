@@ -59,9 +59,10 @@ session_rmsnorm(const txf_t *t, float *o, const float *x, const float *weight,
 		size_t size)
 {
 	// calculate sum of squares
+	cwc_cursor_t cur = { t, NULL, 0, 0 };
 	float ss = 0.0f;
 	const float *w;
-	size_t j;
+	size_t j, k, avail;
 
 	for (j = 0; j < size; j++)
 		ss += x[j] * x[j];
@@ -70,26 +71,33 @@ session_rmsnorm(const txf_t *t, float *o, const float *x, const float *weight,
 	ss += 1e-5f;
 	ss = 1.0f / sqrtf(ss);
 
-	w = clamma_weight_cache(t, weight, size * sizeof(float));
-	if (!w)
-		return 1;
+	/*
+	 * normalize and scale... float tensors are aligned in the model, so a
+	 * float never straddles two cache blocks
+	 */
+	for (j = 0; j < size; j += k) {
+		w = clamma_weight_span(&cur, weight + j,
+				       (size - j) * sizeof(float), &avail);
+		if (!w)
+			break;
+		for (k = 0; k < avail / sizeof(float); k++)
+			o[j + k] = w[k] * (ss * x[j + k]);
+	}
 
-	/* normalize and scale */
-	for (j = 0; j < size; j++)
-		o[j] = w[j] * (ss * x[j]);
+	clamma_weight_span_done(&cur);
 
-	return 0;
+	return j < size;
 }
 
-int
-_session_matmul(txf_session_state_t *tss, float *xout, const float *x, const float *w1,
-		int i, int dlim, int n, int d)
-{
-	const float *w = clamma_weight_cache(tss->t, w1, n * d * sizeof(float));
-
-	if (!w)
-		return 1;
+/*
+ * The bare matmul kernels over rows i .. dlim - 1, on weights that are already
+ * in memory
+ */
 
+void
+clamma_matmul_rows(float *xout, const float *x, const float *w, int i,
+		   int dlim, int n)
+{
 	w += i * n;
 	xout += i;
 
@@ -102,44 +110,134 @@ _session_matmul(txf_session_state_t *tss, float *xout, const float *x, const flo
 
 		*xout++ = f;
 	}
-
-	return 0;
 }
 
-int
-_session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
-		   const qt_t *w1, int i, int dlim, int n, int d)
+void
+clamma_matmul_qt_rows(float *xout, const qt_t *x, const cq_t *w_q,
+		      const float *w_s, unsigned int gs, int i, int dlim, int n)
 {
-	const cq_t *w_q = clamma_weight_cache(tss->t, w1->q,
-				(d * n) + (tss->t->c.group_size * n));
-	const float *w_s = clamma_weight_cache(tss->t, w1->s,
-				((d * n) / tss->t->c.group_size) * sizeof(*w_s));
 	long ln = (long)n;
 
-	if (!w_q || !w_s)
-		return 1;
-
 	for (; i < dlim; i++) {
 
 		float val = 0.0f;
 		int32_t ival = 0;
 		long in = i * n;
 
-		for (long j = 0; j <= ln - (long)tss->t->c.group_size;
-						j += tss->t->c.group_size) {
+		for (long j = 0; j <= ln - (long)gs; j += gs) {
 			ival = 0;
-			for (unsigned int k = 0; k < tss->t->c.group_size; k++)
+			for (unsigned int k = 0; k < gs; k++)
 				ival = ival + (((int32_t)x->q[j + k]) *
 					       ((int32_t)w_q[in + j + k]));
 
-			val += ((float)ival) * w_s[(in + j) / tss->t->c.group_size] *
-						     x->s[j / tss->t->c.group_size];
+			val += ((float)ival) * w_s[(in + j) / gs] *
+						     x->s[j / gs];
 		}
 
 		xout[i] = val;
 	}
+}
 
-	return 0;
+/*
+ * The matmuls take their rows a block's worth at a time from the weight cache,
+ * so each part only pulls in the blocks its rows are in.  A row that straddles
+ * two blocks is assembled in a bounce buffer first.
+ */
+
+int
+_session_matmul(txf_session_state_t *tss, float *xout, const float *x,
+		const float *w1, int i, int dlim, int n)
+{
+	cwc_cursor_t cur = { tss->t, NULL, 0, 0 };
+	size_t row = (size_t)n * sizeof(float), avail;
+	float *bounce = NULL;
+	const float *w;
+	int k, ret = 1;
+
+	while (i < dlim) {
+		w = clamma_weight_span(&cur, w1 + (size_t)i * n,
+				       (size_t)(dlim - i) * row, &avail);
+		if (!w)
+			goto bail;
+
+		k = (int)(avail / row);
+		if (!k) {
+			if (!bounce && !(bounce = malloc(row)))
+				goto bail;
+			if (clamma_weight_read(tss->t, bounce,
+					       w1 + (size_t)i * n, row))
+				goto bail;
+			w = bounce;
+			k = 1;
+		}
+
+		clamma_matmul_rows(xout + i, x, w, 0, k, n);
+		i += k;
+	}
+
+	ret = 0;
+
+bail:
+	clamma_weight_span_done(&cur);
+	free(bounce);
+
+	return ret;
+}
+
+int
+_session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
+		   const qt_t *w1, int i, int dlim, int n)
+{
+	cwc_cursor_t cq = { tss->t, NULL, 0, 0 }, cs = { tss->t, NULL, 0, 0 };
+	unsigned int gs = tss->t->c.group_size;
+	size_t srow = ((size_t)n / gs) * sizeof(float), aq, as;
+	cq_t *bq = NULL;
+	const cq_t *w_q;
+	const float *w_s;
+	float *bs = NULL;
+	int k, ks, ret = 1;
+
+	while (i < dlim) {
+		w_q = clamma_weight_span(&cq, w1->q + (size_t)i * n,
+					 (size_t)(dlim - i) * n, &aq);
+		w_s = clamma_weight_span(&cs, w1->s + ((size_t)i * n) / gs,
+					 (size_t)(dlim - i) * srow, &as);
+		if (!w_q || !w_s)
+			goto bail;
+
+		k = (int)(aq / (size_t)n);
+		ks = (int)(as / srow);
+		if (ks < k)
+			k = ks;
+		if (!k) {
+			if ((!bq && !(bq = malloc((size_t)n))) ||
+			    (!bs && !(bs = malloc(srow))))
+				goto bail;
+			if (clamma_weight_read(tss->t, bq,
+					       w1->q + (size_t)i * n,
+					       (size_t)n) ||
+			    clamma_weight_read(tss->t, bs,
+					       w1->s + ((size_t)i * n) / gs,
+					       srow))
+				goto bail;
+			w_q = bq;
+			w_s = bs;
+			k = 1;
+		}
+
+		clamma_matmul_qt_rows(xout + i, x, w_q, w_s, gs, 0, k, n);
+		i += k;
+	}
+
+	ret = 0;
+
+bail:
+	clamma_weight_span_done(&cq);
+	clamma_weight_span_done(&cs);
+	free(bq);
+	free(bs);
+
+	return ret;
 }
 
 void
@@ -172,34 +270,27 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
 	uint32_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
 		 kv_mul = t->c.n_heads / t->c.n_kv_heads,
 		 head_size = t->c.dim / t->c.n_heads;
-	float *content_row = t->w.token_embedding_table + (token * t->c.dim),
-	      *key_cache_row, *value_cache_row;
-	const float *f = content_row;
+	float *key_cache_row, *value_cache_row;
 	txf_session_state_t *tss = &ts->s.tss;
 
-	switch (t->c.version) {
-	case CLAMMA_MODEL_VERSION1_FLOAT:
-		f = clamma_weight_cache(t, content_row,
-					t->c.dim * sizeof(*ts->s.x));
-		if (!f)
-			goto bail;
-		break;
-	}
-
 	/*
 	 * Copy the initial token embedding into ts->s.x, this is updated twice
 	 * per layer with "residuals"
 	 */
 
-	memcpy(ts->s.x, f, t->c.dim * sizeof(*ts->s.x));
+	if (clamma_txf_embedding(t, ts->s.x, token))
+		goto bail;
 
 	/* for each layer... */
 
 	for (uint64_t l = 0; l < t->c.n_layers; l++) {
-		int loff = l * t->c.seq_len * kv_dim;
+		int loff = l * ts->kv_len * kv_dim;
 
 		// uint64_t start = clamma_timestamp_ns();
 
+		/* have the next layer's weights loaded while we do this one */
+		clamma_weight_prefetch(t, (unsigned int)l + 1);
+
 		/*
 		 * this section parallelizeable ------>
 		 */
@@ -293,6 +384,10 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
 		 *            <-- value_cache, att
 		 */
 
+#if defined(LIBCLAMMA_WITH_OPENMP)
+		/* the heads are independent, share them out over the team */
+#pragma omp parallel for num_threads(t->omp_threads)
+#endif
 		for (uint32_t h = 0; h < t->c.n_heads; h++) {
 			/* get the query vector for this head */
 			float *q = tss->q + h * head_size, *xb,
@@ -469,6 +564,9 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
 	 * All tss threads must be idle by here
 	 */
 
+	/* ...and the first layer again while we do the classifier */
+	clamma_weight_prefetch(t, 0);
+
 	/* final session_rmsnorm
 	 *
 	 *  ts->s.x <-- matmul(ts.s.x, rms_final_weight)
@@ -0,0 +1,130 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ *
+ * This is the OpenMP alternative to the job rings and worker pool in smp.c and
+ * smp-pthreads.c, it only gets built if the cmake option
+ * -DLIBCLAMMA_THREADING=OPENMP
+ *
+ * Each matmul is done in an OpenMP parallel region before returning, which
+ * makes the sync points no-ops.  The team size comes from info.threads, and
+ * how the rows are scheduled over it can be chosen at runtime with the usual
+ * OMP_SCHEDULE, OMP_WAIT_POLICY and OMP_PROC_BIND / OMP_PLACES environment,
+ * so it can be benchmarked against the PTHREADS pool on the same host.
+ */
+
+#include "private.h"
+#include <omp.h>
+
+/*
+ * Rows are handed out in blocks of this many, and matmuls with fewer than
+ * SMP_OMP_MIN_MACS multiply-adds aren't worth a parallel region at all
+ */
+#define SMP_OMP_BLOCK_ROWS	32
+#define SMP_OMP_MIN_MACS	(64 * 1024)
+
+int
+clamma_smp_init(txf_t *t, unsigned int threads, const clamma_cpuset_t *cs,
+		const char *pool_name)
+{
+	static int sessions_lock_ready;
+
+	(void)pool_name;
+
+	/*
+	 * The application may still step sessions from threads of its own,
+	 * mut_sessions has to work even though we never create any.  There's
+	 * no static initializer for an OpenMP lock, so it's created with the
+	 * first transformer and then kept for the life of the process.
+	 */
+
+#pragma omp critical (clamma_smp_init)
+	if (!sessions_lock_ready) {
+		clamma_mutex_init(&mut_sessions);
+		sessions_lock_ready = 1;
+	}
+
+	if (threads > LIBCLAMMA_MAX_THREADS)
+		threads = LIBCLAMMA_MAX_THREADS;
+
+	t->omp_threads = (int)threads;
+
+	/* there are no per-node workers here to read a replica */
+	t->numa_replicate = 0;
+
+	/*
+	 * Placement is up to OMP_PROC_BIND / OMP_PLACES, we can only complain
+	 * about a cpu list we're not going to apply
+	 */
+
+	if (clamma_cpuset_nth(cs, 0) >= 0)
+		fprintf(stderr, "%s: ignoring cpus with OpenMP, use OMP_PLACES\n",
+				__func__);
+
+	return 0;
+}
+
+/*
+ * Each block of rows gets its own weights from the cache, so the team only
+ * pulls in the cache blocks its rows are in
+ */
+
+int
+session_matmul(txf_session_state_t *tss, float *xout, const float *x,
+	       const float *w1, int n, int d)
+{
+	int blocks = (d + SMP_OMP_BLOCK_ROWS - 1) / SMP_OMP_BLOCK_ROWS, ret = 0;
+
+#pragma omp parallel for schedule(runtime) num_threads(tss->t->omp_threads) \
+			if ((long)n * d >= SMP_OMP_MIN_MACS) reduction(|:ret)
+	for (int b = 0; b < blocks; b++) {
+		int i = b * SMP_OMP_BLOCK_ROWS;
+
+		ret |= _session_matmul(tss, xout, x, w1, i,
+				       i + SMP_OMP_BLOCK_ROWS > d ? d :
+					i + SMP_OMP_BLOCK_ROWS, n);
+	}
+
+	return ret;
+}
+
+int
+session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
+		  const qt_t *w1, int n, int d)
+{
+	int blocks = (d + SMP_OMP_BLOCK_ROWS - 1) / SMP_OMP_BLOCK_ROWS, ret = 0;
+
+#pragma omp parallel for schedule(runtime) num_threads(tss->t->omp_threads) \
+			if ((long)n * d >= SMP_OMP_MIN_MACS) reduction(|:ret)
+	for (int b = 0; b < blocks; b++) {
+		int i = b * SMP_OMP_BLOCK_ROWS;
+
+		ret |= _session_matmul_qt(tss, xout, x, w1, i,
+					  i + SMP_OMP_BLOCK_ROWS > d ? d :
+					   i + SMP_OMP_BLOCK_ROWS, n);
+	}
+
+	return ret;
+}
@@ -40,16 +40,44 @@
 void
 clamma_smp_sync_point(txf_session_state_t *tss)
 {
-	do {
+	uint64_t until;
+	unsigned int n = 0;
+
+	clamma_smp_help(tss);
+
+	/*
+	 * Matmuls on small models are over in microseconds, so spin for a
+	 * while before paying for a sleep and wake
+	 */
+
+	if (tss->t->spin_ns) {
+		until = clamma_timestamp_ns() + tss->t->spin_ns;
+		while (atomic_load_explicit(&tss->queued, memory_order_acquire) &&
+		       clamma_spin_more(until, &n))
+			;
+	}
+
+	if (!atomic_load(&tss->queued))
+		return;
+
+	/*
+	 * Park... we flag it in queued itself, so either we see the count
+	 * already reached zero, or the worker completing our last job sees
+	 * the flag as it decrements and posts sem_done.  Either way, it
+	 * doesn't touch tss after its decrement unless we're waiting.
+	 */
+
+	if (atomic_fetch_or(&tss->queued, SMP_TSS_PARKED) & ~SMP_TSS_PARKED)
 		clamma_sem_wait(&tss->sem_done);
-		if (!tss->queued)
-			return;
-	} while (1);
+
+	atomic_fetch_and(&tss->queued, ~SMP_TSS_PARKED);
 }
 
 int
 clamma_smp_tss_init(txf_session_state_t *tss)
 {
+	atomic_init(&tss->queued, 0);
+
 	return clamma_sem_init(&tss->sem_done);
 }
 
@@ -59,62 +87,164 @@ clamma_smp_tss_deinit(txf_session_state_t *tss)
 	clamma_sem_destroy(&tss->sem_done);
 }
 
-void
-clamma_smp_deinit(void)
+static pthread_mutex_t mut_pools = PTHREAD_MUTEX_INITIALIZER;
+static clamma_pool_t *pools; /* named pools, protected by mut_pools */
+static char sessions_lock_ready; /* protected by mut_pools */
+
+static void
+pool_destroy(clamma_pool_t *p)
 {
 	void *vret;
 	unsigned int n;
 
-	if (--thread_init_refcount)
-		return;
-
-	for (n = 0; n < count_threads; n++)
-		if (work_threads[n].running) {
-			work_threads[n].exiting = 1;
-			clamma_sem_post(&work_threads[n].sem_start);
-			pthread_join(work_threads[n].pt, &vret);
-			clamma_sem_destroy(&work_threads[n].sem_start);
-			work_threads[n].running = 0;
+	for (n = 0; n < p->count_threads; n++)
+		if (p->work_threads[n].running) {
+			atomic_store(&p->work_threads[n].exiting, 1);
+			atomic_fetch_add(&p->gen, 1);
+			clamma_sem_post(&p->work_threads[n].sem_start);
+			pthread_join(p->work_threads[n].pt, &vret);
+			clamma_sem_destroy(&p->work_threads[n].sem_start);
+			p->work_threads[n].running = 0;
 		}
 
-	pthread_mutex_destroy(&work.mut_job);
-	pthread_mutex_destroy(&mut_sessions);
-	count_threads = 0;
-	free(work_threads);
+	free(p->work_threads);
+	free(p);
 }
 
-int
-clamma_smp_init(unsigned int threads)
+static clamma_pool_t *
+pool_create(const char *name, unsigned int threads, const clamma_cpuset_t *cs,
+	    const txf_t *t)
 {
+	clamma_pool_t *p;
 	unsigned int n;
 
-	if (thread_init_refcount++)
-		return 0;
-
-	work_threads = malloc(sizeof(*work_threads) * threads);
-	if (!work_threads)
-		return 1;
-	memset(work_threads, 0, sizeof(*work_threads) * threads);
-	count_threads = threads;
+	p = aligned_alloc(_Alignof(clamma_pool_t), sizeof(*p));
+	if (!p)
+		return NULL;
+	memset(p, 0, sizeof(*p));
+
+	atomic_init(&p->gen, 0);
+	atomic_init(&p->rr, 0);
+	p->refcount = 1;
+	if (name)
+		strncpy(p->name, name, sizeof(p->name) - 1);
+
+	/* the job rings are cacheline-aligned */
+	p->work_threads = aligned_alloc(_Alignof(work_threads_t),
+					sizeof(*p->work_threads) * threads);
+	if (!p->work_threads) {
+		free(p);
+		return NULL;
+	}
+	memset(p->work_threads, 0, sizeof(*p->work_threads) * threads);
+	p->count_threads = threads;
+
+	for (n = 0; n < p->count_threads; n++) {
+		work_threads_t *w = &p->work_threads[n];
+		int cpu = clamma_cpuset_nth(cs, n);
+
+		clamma_job_ring_init(&w->ring);
+		w->pool = p;
+
+		/*
+		 * The workers apply this to themselves when they start... if
+		 * we're replicating the model per node without a cpu list, we
+		 * spread the workers over the nodes so they have a replica
+		 */
+
+		w->node = -1;
+		if (cpu >= 0) {
+			w->pin.b[cpu / 64] |= 1ull << (cpu % 64);
+			w->node = clamma_cpu_node(cpu);
+		} else if (t->numa_replicate) {
+			w->node = clamma_numa_nth_node(t->numa_nodes, n);
+			if (w->node >= 0 && clamma_node_cpus(w->node, &w->pin))
+				w->node = -1;
+		}
+		w->numa = t->numa;
+		w->numa_nodes = t->numa_nodes;
+	}
 
-	for (n = 0; n < count_threads; n++) {
-		if (clamma_sem_init(&work_threads[n].sem_start))
+	for (n = 0; n < p->count_threads; n++) {
+		if (clamma_sem_init(&p->work_threads[n].sem_start))
 			goto bail;
 
-		if (pthread_create(&work_threads[n].pt, NULL,
+		if (pthread_create(&p->work_threads[n].pt, NULL,
 				   clamma_session_worker,
-				   &work_threads[n])) {
-			clamma_sem_destroy(&work_threads[n].sem_start);
+				   &p->work_threads[n])) {
+			clamma_sem_destroy(&p->work_threads[n].sem_start);
 bail:
-			clamma_smp_deinit();
+			pool_destroy(p);
 
-			return 1;
+			return NULL;
 		}
-		work_threads[n].running = 1;
+		p->work_threads[n].running = 1;
 	}
 
-	clamma_mutex_init(&work.mut_job);
-	clamma_mutex_init(&mut_sessions);
+	clamma_smp_calibrate(p, t);
+
+	return p;
+}
+
+void
+clamma_smp_deinit(txf_t *t)
+{
+	clamma_pool_t **pp;
+
+	pthread_mutex_lock(&mut_pools);
+
+	if (t->pool && !--t->pool->refcount) {
+		for (pp = &pools; *pp; pp = &(*pp)->next)
+			if (*pp == t->pool) {
+				*pp = t->pool->next;
+				break;
+			}
+		pool_destroy(t->pool);
+	}
+	t->pool = NULL;
+
+	pthread_mutex_unlock(&mut_pools);
+}
+
+int
+clamma_smp_init(txf_t *t, unsigned int threads, const clamma_cpuset_t *cs,
+		const char *pool_name)
+{
+	clamma_pool_t *p = NULL;
+
+	pthread_mutex_lock(&mut_pools);
+
+	/*
+	 * mut_sessions is created with the first transformer and kept for the
+	 * life of the process, so pools coming and going (as when the thread
+	 * count is tuned) never pull it out from under sessions of others
+	 */
+
+	if (!sessions_lock_ready) {
+		clamma_mutex_init(&mut_sessions);
+		sessions_lock_ready = 1;
+	}
+
+	/* attach to the named pool if it exists already */
+
+	if (pool_name && pool_name[0])
+		for (p = pools; p; p = p->next)
+			if (!strcmp(p->name, pool_name)) {
+				p->refcount++;
+				break;
+			}
+
+	if (!p) {
+		p = pool_create(pool_name, threads, cs, t);
+		if (p && pool_name && pool_name[0]) {
+			p->next = pools;
+			pools = p;
+		}
+	}
+
+	pthread_mutex_unlock(&mut_pools);
+
+	t->pool = p;
 
-	return 0;
+	return !p;
 }
@@ -30,9 +30,6 @@
 
 #include "private.h"
 
-work_threads_t *work_threads;
-work_t work;
-unsigned int count_threads, thread_init_refcount;
 
 // #define SESSION_THREAD_SHOW_OCCUPANCY
 // #define LOG_MATRIX_MUL
@@ -42,85 +39,608 @@ unsigned int count_threads, thread_init_refcount;
 int fd_log = -1, log_line = 1;
 #endif
 
+#define JOB_RING_MASK (LIBCLAMMA_MAX_THREAD_JOB_QUEUE - 1)
+
+/*
+ * Matmuls are split into at least SMP_MIN_TASKS_PER_THREAD tasks per worker,
+ * so a slow or preempted worker's share can be stolen by the others, and more
+ * if that's what it takes for each task's weights to fit in L2.  Tasks always
+ * have enough rows to be worth queuing, and matmuls that would take less than
+ * SMP_SERIAL_FACTOR handoffs to do inline are not split at all.
+ */
+#define SMP_MIN_TASKS_PER_THREAD	2
+#define SMP_MAX_TASKS_PER_THREAD	4
+#define SMP_MIN_TASK_ROWS		32
+#define SMP_SERIAL_FACTOR		2
+
+/* size of the matmuls we time to calibrate the cost model */
+#define SMP_CAL_N			256
+#define SMP_CAL_GS			32
+
+#if defined(SMP_SHOW_TAIL_LATENCY)
+/* log2 us buckets of the time from first to last job completion in a batch */
+static atomic_ullong tail_hist[24], batches;
+#endif
+
+void
+clamma_job_ring_init(job_ring_t *r)
+{
+	size_t n;
+
+	for (n = 0; n < CLAMMA_ARRAY_SIZE(r->job_ring); n++)
+		atomic_init(&r->job_ring[n].seq, n);
+
+	atomic_init(&r->job_head, 0);
+	atomic_init(&r->job_tail, 0);
+}
+
+void
+clamma_job_enqueue(job_ring_t *r, const job_t *j)
+{
+	size_t pos = atomic_load_explicit(&r->job_head, memory_order_relaxed);
+	job_cell_t *c;
+	intptr_t dif;
+
+	while (1) {
+		c = &r->job_ring[pos & JOB_RING_MASK];
+		dif = (intptr_t)atomic_load_explicit(&c->seq,
+					memory_order_acquire) - (intptr_t)pos;
+		if (!dif) {
+			if (atomic_compare_exchange_weak_explicit(
+					&r->job_head, &pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+			continue;
+		}
+
+		/*
+		 * If dif < 0, the cell still holds the job from the last lap:
+		 * either the ring is full, or a consumer took it past
+		 * job_tail but hasn't finished copying it out, while others
+		 * took later jobs.  That happens with only a couple of jobs
+		 * in the ring, so it's not an error, the consumers free the
+		 * cell in a moment.
+		 */
+		if (dif < 0)
+			clamma_cpu_relax();
+
+		pos = atomic_load_explicit(&r->job_head,
+					   memory_order_relaxed);
+	}
+
+	c->job = *j;
+	atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Returns 0 if *j was filled with a job, or 1 if the ring is empty
+ */
+
+int
+clamma_job_dequeue(job_ring_t *r, job_t *j)
+{
+	size_t pos = atomic_load_explicit(&r->job_tail, memory_order_relaxed);
+	job_cell_t *c;
+	intptr_t dif;
+
+	while (1) {
+		c = &r->job_ring[pos & JOB_RING_MASK];
+		dif = (intptr_t)atomic_load_explicit(&c->seq,
+				memory_order_acquire) - (intptr_t)(pos + 1);
+		if (!dif) {
+			if (atomic_compare_exchange_weak_explicit(
+					&r->job_tail, &pos, pos + 1,
+					memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+			continue;
+		}
+
+		if (dif < 0)
+			return 1;
+
+		pos = atomic_load_explicit(&r->job_tail,
+					   memory_order_relaxed);
+	}
+
+	*j = c->job;
+	atomic_store_explicit(&c->seq, pos + LIBCLAMMA_MAX_THREAD_JOB_QUEUE,
+			      memory_order_release);
+
+	return 0;
+}
+
+/*
+ * Take the next job from our own ring, or if that's empty, steal one from the
+ * other workers' rings.  Returns 0 if *j was filled, or 1 if there's nothing.
+ */
+
+static int
+job_next(work_threads_t *w, job_t *j)
+{
+	clamma_pool_t *p = w->pool;
+	unsigned int m = (unsigned int)(w - p->work_threads), n, pass;
+
+	if (!clamma_job_dequeue(&w->ring, j))
+		return 0;
+
+	/* steal from workers on our own node first, then from any */
+
+	for (pass = 0; pass < 2; pass++)
+		for (n = 1; n < p->count_threads; n++) {
+			work_threads_t *v = &p->work_threads[(m + n) %
+							     p->count_threads];
+
+			if (!pass && v->node != w->node)
+				continue;
+			if (!clamma_job_dequeue(&v->ring, j)) {
+#if defined(SMP_SHOW_TAIL_LATENCY)
+				w->steals++;
+#endif
+				return 0;
+			}
+		}
+
+	return 1;
+}
+
+/*
+ * If the transformer has a replica of the model on our node, translate a
+ * pointer into the model to the same place in the replica
+ */
+
+static const void *
+smp_local(const txf_t *t, int node, const void *p)
+{
+	const uint8_t *u = (const uint8_t *)p, *base = (const uint8_t *)t->data;
+
+	if (node < 0 || !t->replica[node] || u < base ||
+	    u >= base + t->file_size)
+		return p;
+
+	return t->replica[node] + (u - base);
+}
+
+/*
+ * Do the job and account for its completion, waking the session it was for if
+ * it was the last one the session was waiting for
+ */
+
+static void
+smp_run_job(const job_t *j, int node)
+{
+	const txf_t *t = j->tss->t;
+	int queued;
+	qt_t lw;
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	unsigned long long first = 0, now;
+#endif
+
+	switch (j->type) {
+	case CLAMMA_JOB_MATMUL:
+		_session_matmul(j->tss, j->xout, j->x,
+				smp_local(t, node, j->w1), j->i, j->dlim,
+				j->n);
+		break;
+	case CLAMMA_JOB_MATMUL_QT:
+		lw.q = (int8_t *)smp_local(t, node, j->qt_w->q);
+		lw.s = (float *)smp_local(t, node, j->qt_w->s);
+		_session_matmul_qt(j->tss, j->xout, j->qt_x, &lw, j->i,
+				   j->dlim, j->n);
+		break;
+	}
+
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	/* note when the batch's first job completed */
+	now = clamma_timestamp_ns();
+	if (atomic_compare_exchange_strong(&j->tss->first_done, &first, now))
+		first = now;
+#endif
+
+	queued = atomic_fetch_sub(&j->tss->queued, 1);
+	assert(queued > 0);
+
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	if ((queued & ~SMP_TSS_PARKED) == 1) {
+		unsigned int b = 0;
+		uint64_t us = (clamma_timestamp_ns() - first) / 1000;
+
+		while (us && b < CLAMMA_ARRAY_SIZE(tail_hist) - 1) {
+			us >>= 1;
+			b++;
+		}
+		atomic_fetch_add(&tail_hist[b], 1);
+		atomic_fetch_add(&batches, 1);
+	}
+#endif
+
+	if (queued == (SMP_TSS_PARKED | 1))
+		/* let parked tss know its jobs are completed */
+		clamma_sem_post(&j->tss->sem_done);
+}
+
+/*
+ * The session thread runs queued jobs itself while it waits for its own to
+ * complete, rather than idling while there's work it could be doing.  When
+ * the rings are empty, what's left of our jobs is already being done.
+ */
+
+void
+clamma_smp_help(txf_session_state_t *tss)
+{
+	clamma_pool_t *p = tss->t->pool;
+	unsigned int m, n;
+	job_t j;
+
+	while (atomic_load(&tss->queued)) {
+		m = atomic_load_explicit(&p->rr, memory_order_relaxed);
+
+		for (n = 0; n < p->count_threads; n++)
+			if (!clamma_job_dequeue(&p->work_threads[(m + n) %
+					p->count_threads].ring, &j))
+				break;
+
+		if (n == p->count_threads)
+			return;
+
+		smp_run_job(&j, -1);
+	}
+}
+
+/*
+ * Wake any workers that parked themselves, after new jobs were queued... the
+ * generation bump pairs with the worker storing parked and then checking the
+ * generation, so either the worker sees the new generation, or we see it parked
+ */
+
+static void
+smp_wake_workers(clamma_pool_t *p)
+{
+	unsigned int m;
+
+	atomic_fetch_add(&p->gen, 1);
+
+	for (m = 0; m < p->count_threads; m++)
+		if (atomic_load(&p->work_threads[m].parked) &&
+		    atomic_exchange(&p->work_threads[m].parked, 0))
+			clamma_sem_post(&p->work_threads[m].sem_start);
+}
+
 void *
 clamma_session_worker(void *tp)
 {
 	work_threads_t *w = (work_threads_t *)tp;
+	clamma_pool_t *p = w->pool;
+	uint64_t spin_ns = 0;
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
 	uint64_t ns = 0, begin = clamma_timestamp_ns(), start, end;
 #endif
 
+	clamma_thread_placement(&w->pin, w->numa, w->numa_nodes);
+
 	while (1) {
+		uint64_t until;
+		unsigned int n;
 		job_t temp;
+		int seen;
 
-		clamma_sem_wait(&w->sem_start);
+		seen = atomic_load(&p->gen);
 
 		while (1) { /* while jobs in ring to do */
 
-			if (w->exiting)
+			if (atomic_load(&w->exiting))
 				goto bail;
 
-			clamma_mutex_lock(&work.mut_job);
-			if (work.job_tail == work.job_head) {
-				/* ring is empty, wait for sem */
-				clamma_mutex_unlock(&work.mut_job);
+			if (job_next(w, &temp))
+				/* all the rings are empty */
 				break;
-			}
-			temp = work.job_ring[work.job_tail];
-			work.job_tail = (work.job_tail + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-			clamma_mutex_unlock(&work.mut_job);
 
+			spin_ns = temp.tss->t->spin_ns;
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
 			start = clamma_timestamp_ns();
 #endif
-			switch (temp.type) {
-			case CLAMMA_JOB_MATMUL:
-				_session_matmul(temp.tss, temp.xout, temp.x,
-						temp.w1, temp.i, temp.dlim,
-						temp.n, temp.d);
-			break;
-			case CLAMMA_JOB_MATMUL_QT:
-				_session_matmul_qt(temp.tss, temp.xout,
-						   temp.qt_x, temp.qt_w, temp.i,
-						   temp.dlim, temp.n, temp.d);
-			break;
-			}
+			smp_run_job(&temp, w->node);
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
 			ns += clamma_timestamp_ns() - start;
 #endif
+		}
 
-			clamma_mutex_lock(&work.mut_job);
-			assert(temp.tss->queued);
-			if (!--temp.tss->queued)
-				/* let tss know its jobs are completed */
-				clamma_sem_post(&temp.tss->sem_done);
-
-			clamma_mutex_unlock(&work.mut_job);
+		/*
+		 * Spin for a while waiting for the next generation of jobs,
+		 * using the budget of the transformer we last worked for...
+		 * we keep a copy, since it may be gone by now
+		 */
+
+		if (spin_ns) {
+			until = clamma_timestamp_ns() + spin_ns;
+			n = 0;
+			while (atomic_load_explicit(&p->gen,
+					memory_order_relaxed) == seen &&
+			       clamma_spin_more(until, &n))
+				;
+			if (atomic_load(&p->gen) != seen)
+				continue;
 		}
+
+		/* nothing came, park until a producer wakes us */
+
+		atomic_store(&w->parked, 1);
+		if (atomic_load(&p->gen) != seen &&
+		    atomic_exchange(&w->parked, 0))
+			/* new jobs raced us parking, and we unparked first */
+			continue;
+
+		clamma_sem_wait(&w->sem_start);
 	}
 
 bail:
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
 	end = clamma_timestamp_ns();
-	fprintf(stderr, "t%d: %llums / %llums\n", (int)(w - work_threads),
+	fprintf(stderr, "t%d: %llums / %llums\n", (int)(w - p->work_threads),
 			(unsigned long long)ns / 1000000ull,
 			(end - begin) / 1000000ull);
 #endif
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	fprintf(stderr, "t%d: steals %llu\n", (int)(w - p->work_threads),
+			(unsigned long long)w->steals);
+	if (w == p->work_threads) {
+		unsigned int b;
+
+		fprintf(stderr, "smp batch tail latency (first to last job "
+				"done), %llu batches:\n",
+				(unsigned long long)atomic_load(&batches));
+		for (b = 0; b < CLAMMA_ARRAY_SIZE(tail_hist); b++)
+			if (atomic_load(&tail_hist[b]))
+				fprintf(stderr, "  < %8uus: %llu\n", 1u << b,
+					(unsigned long long)atomic_load(
+							&tail_hist[b]));
+	}
+#endif
 
 	pthread_exit(NULL);
 }
 
 /*
- * These are the pthreads-aware version of matmul[_qt] that splits each run into
- * tc parts and queues them up for the threads to handle concurrently
+ * Decide how many tasks to split the job into, from what it costs to do the
+ * job inline compared to handing it off to the workers.  1 means do it inline.
+ */
+
+static unsigned int
+smp_parts(const clamma_pool_t *p, const job_t *j)
+{
+	uint64_t work_ns = ((uint64_t)j->n * (uint64_t)j->d *
+					p->mac_ps[j->type]) / 1000;
+	size_t bytes = (size_t)j->n * (size_t)j->d * (j->type == CLAMMA_JOB_MATMUL ?
+					sizeof(float) : sizeof(cq_t));
+	unsigned int parts, most, use;
+
+	if (work_ns < p->handoff_ns * SMP_SERIAL_FACTOR)
+		return 1;
+
+	/* only wake as many workers as the work can pay for */
+
+	use = p->handoff_ns ? (unsigned int)(work_ns / p->handoff_ns) :
+			      p->count_threads;
+	if (use > p->count_threads)
+		use = p->count_threads;
+
+	/* tiles that fit in L2, but enough per worker to balance the load */
+
+	parts = (unsigned int)((bytes + p->tile_bytes - 1) / p->tile_bytes);
+	if (parts < use * SMP_MIN_TASKS_PER_THREAD)
+		parts = use * SMP_MIN_TASKS_PER_THREAD;
+	if (parts > use * SMP_MAX_TASKS_PER_THREAD)
+		parts = use * SMP_MAX_TASKS_PER_THREAD;
+
+	most = (unsigned int)j->d / SMP_MIN_TASK_ROWS;
+	if (parts > most)
+		parts = most;
+
+	return parts < 2 ? 1 : parts;
+}
+
+/*
+ * Split the job over d into parts tasks and spread them over the worker rings
+ */
+
+static void
+smp_dispatch(job_t *j, unsigned int parts)
+{
+	txf_session_state_t *tss = j->tss;
+	clamma_pool_t *p = tss->t->pool;
+	int part = 0, step = j->d / (int)parts;
+	unsigned int m, rr;
+
+#if defined(SMP_SHOW_TAIL_LATENCY)
+	if (!atomic_load(&tss->queued))
+		/* starting a new batch of jobs for this sync point */
+		atomic_store(&tss->first_done, 0);
+#endif
+
+	/*
+	 * Account for all the parts before any are queued, so the workers
+	 * can't see the count reach zero until the last part is done
+	 */
+
+	atomic_fetch_add_explicit(&tss->queued, (int)parts,
+				  memory_order_relaxed);
+
+	rr = atomic_fetch_add_explicit(&p->rr, parts, memory_order_relaxed);
+
+	for (m = 0; m < parts; m++) {
+		j->i	= part;
+		j->dlim	= m == parts - 1 ? j->d : part + step;
+		part += step;
+
+		clamma_job_enqueue(&p->work_threads[(rr + m) %
+						     p->count_threads].ring, j);
+	}
+
+	smp_wake_workers(p);
+}
+
+static void
+smp_queue(job_t *j)
+{
+	unsigned int parts = smp_parts(j->tss->t->pool, j);
+
+	if (parts > 1) {
+		smp_dispatch(j, parts);
+		return;
+	}
+
+	/* cheaper to do it ourselves than to wake anybody */
+
+	j->i	= 0;
+	j->dlim	= j->d;
+	atomic_fetch_add_explicit(&j->tss->queued, 1, memory_order_relaxed);
+	smp_run_job(j, -1);
+}
+
+/*
+ * Time what the matmul kernels cost per multiply-add on this cpu, and what it
+ * costs to hand a trivial matmul to the workers and sync on it, so smp_parts()
+ * can weigh one against the other.  It's done once when the pool is created.
+ */
+
+static uint64_t
+smp_l2_size(void)
+{
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	if (l2 > 0)
+		return (uint64_t)l2;
+#endif
+
+	return 256 * 1024;
+}
+
+void
+clamma_smp_calibrate(clamma_pool_t *p, const txf_t *t)
+{
+	size_t nw = SMP_CAL_N * SMP_CAL_N;
+	uint64_t t0, best[2] = { ~0ull, ~0ull }, sum = 0;
+	txf_session_state_t tss;
+	float *w, *x, *xout;
+	qt_t qw, qx;
+	txf_t *ct;
+	job_t j;
+	int n;
+
+	/* half of L2 for the task's weights, the rest for x and everything else */
+	p->tile_bytes = (size_t)smp_l2_size() / 2;
+
+	/* until we know better, always split, like before the cost model */
+	p->handoff_ns = 0;
+	p->mac_ps[CLAMMA_JOB_MATMUL] = p->mac_ps[CLAMMA_JOB_MATMUL_QT] = 1000;
+
+	/*
+	 * The kernels and the sync need a session on a transformer that uses
+	 * this pool, but we don't want to involve the real one, which doesn't
+	 * have a model yet
+	 */
+
+	ct = malloc(sizeof(*ct));
+	if (!ct)
+		return;
+	memset(ct, 0, sizeof(*ct));
+	ct->pool	= p;
+	ct->spin_ns	= t->spin_ns;
+	ct->model_access = CLAMMA_MODEL_ACCESS_MMAP;
+	ct->c.group_size = SMP_CAL_GS;
+
+	memset(&tss, 0, sizeof(tss));
+	tss.t = ct;
+	if (clamma_smp_tss_init(&tss))
+		goto bail1;
+
+	w = malloc((nw + SMP_CAL_N * 2) * sizeof(float) + nw + SMP_CAL_N +
+		   ((nw + SMP_CAL_N) / SMP_CAL_GS) * sizeof(float));
+	if (!w)
+		goto bail2;
+
+	x	= w + nw;
+	xout	= x + SMP_CAL_N;
+	qw.s	= xout + SMP_CAL_N;
+	qx.s	= qw.s + nw / SMP_CAL_GS;
+	qw.q	= (int8_t *)(qx.s + SMP_CAL_N / SMP_CAL_GS);
+	qx.q	= qw.q + nw;
+
+	for (n = 0; n < (int)nw; n++) {
+		w[n] = (float)(n & 15) * 0.01f;
+		qw.q[n] = (int8_t)(n & 127);
+	}
+	for (n = 0; n < (int)(nw / SMP_CAL_GS); n++)
+		qw.s[n] = 0.01f;
+	for (n = 0; n < SMP_CAL_N; n++) {
+		x[n] = 0.5f;
+		qx.q[n] = 1;
+	}
+	for (n = 0; n < SMP_CAL_N / SMP_CAL_GS; n++)
+		qx.s[n] = 1.0f;
+
+	/* the best of a few inline runs of each kernel */
+
+	for (n = 0; n < 4; n++) {
+		t0 = clamma_timestamp_ns();
+		_session_matmul(&tss, xout, x, w, 0, SMP_CAL_N, SMP_CAL_N);
+		t0 = clamma_timestamp_ns() - t0;
+		if (t0 < best[CLAMMA_JOB_MATMUL])
+			best[CLAMMA_JOB_MATMUL] = t0;
+
+		t0 = clamma_timestamp_ns();
+		_session_matmul_qt(&tss, xout, &qx, &qw, 0, SMP_CAL_N,
+				   SMP_CAL_N);
+		t0 = clamma_timestamp_ns() - t0;
+		if (t0 < best[CLAMMA_JOB_MATMUL_QT])
+			best[CLAMMA_JOB_MATMUL_QT] = t0;
+	}
+
+	for (n = 0; n < 2; n++)
+		p->mac_ps[n] = (unsigned int)((best[n] * 1000) / nw) + 1;
+
+	/*
+	 * The average cost of a round trip through the workers, for a matmul
+	 * too small for the work to count, after a couple to warm up
+	 */
+
+	j.tss	= &tss;
+	j.type	= CLAMMA_JOB_MATMUL;
+	j.xout	= xout;
+	j.x	= x;
+	j.w1	= w;
+	j.n	= SMP_CAL_GS;
+	j.d	= (int)p->count_threads;
+
+	for (n = 0; n < 18; n++) {
+		t0 = clamma_timestamp_ns();
+		smp_dispatch(&j, p->count_threads);
+		clamma_smp_sync_point(&tss);
+		if (n >= 2)
+			sum += clamma_timestamp_ns() - t0;
+	}
+
+	p->handoff_ns = sum / 16;
+
+	free(w);
+bail2:
+	clamma_smp_tss_deinit(&tss);
+bail1:
+	free(ct);
+}
+
+/*
+ * These are the pthreads-aware version of matmul[_qt] that split each run into
+ * parts and queue them up for the threads to handle concurrently
  */
 
 int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x,
 	       const float *w1, int n, int d)
 {
-	unsigned int m, part = 0;
+	job_t j;
 
 #if defined(LOG_MATRIX_MUL)
 	char log[256];
@@ -132,7 +652,7 @@ session_matmul(txf_session_state_t *tss, float *xout, const float *x,
 		size_t sl = snprintf(log, sizeof(log), "%u, %llu, %llu, %llu, %llu\n",
 				log_line++, (unsigned long long)((uint8_t *)x -
 							(uint8_t *)ts->x),
-				(unsigned long long)((uint8_t *)w1 - (uint8_t *)tss->t->w.token_embedding_table),
+				(unsigned long long)((uint8_t *)w1 - (uint8_t *)tss->t->data),
 	/* extent of x repeatedly covered */	(unsigned long long)(d),
 	/* extent of w1 covered once each */	(unsigned long long)(n));
 		write(fd_log, log, sl);
@@ -140,36 +660,15 @@ session_matmul(txf_session_state_t *tss, float *xout, const float *x,
 
 #endif
 
-	clamma_mutex_lock(&work.mut_job);
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_MATMUL;
+	j.xout	= xout;
+	j.x	= x;
+	j.w1	= w1;
+	j.n	= n;
+	j.d	= d;
 
-	for (m = 0; m < count_threads; m++) {
-		job_t *j = &work.job_ring[work.job_head];
-
-		j->tss	= tss;
-		j->type = CLAMMA_JOB_MATMUL;
-		j->xout	= xout;
-		j->x	= x;
-		j->w1	= w1;
-		j->i	= part;
-		j->n	= n;
-		j->d	= d;
-		j->dlim	= m == count_threads - 1 ? (unsigned int)d :
-						   part + (d / count_threads);
-
-		part += d / count_threads;
-		work.job_head = (work.job_head + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-		/* the job ring needs to be bigger */
-		assert(work.job_head != work.job_tail);
-		tss->queued++;
-		/* the job ring needs to be bigger */
-		assert(tss->queued < (int)CLAMMA_ARRAY_SIZE(work.job_ring));
-	}
-
-	clamma_mutex_unlock(&work.mut_job);
-
-	for (m = 0; m < count_threads; m++)
-		clamma_sem_post(&work_threads[m].sem_start);
+	smp_queue(&j);
 
 	return 0;
 }
@@ -178,34 +677,17 @@ int
 session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
 		 const qt_t *w1, int n, int d)
 {
-	unsigned int m, part = 0;
-
-	clamma_mutex_lock(&work.mut_job);
-
-	for (m = 0; m < count_threads; m++) {
-		job_t *j = &work.job_ring[work.job_head];
-
-		j->tss	= tss;
-		j->type = CLAMMA_JOB_MATMUL_QT;
-		j->xout	= xout;
-		j->qt_x	= x;
-		j->qt_w	= w1;
-		j->i	= part;
-		j->n	= n;
-		j->d	= d;
-		j->dlim	= m == count_threads - 1 ? (unsigned int)d :
-					part + (d / count_threads);
-
-		part += d / count_threads;
-		work.job_head = (work.job_head + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-		tss->queued++;
-	}
+	job_t j;
 
-	clamma_mutex_unlock(&work.mut_job);
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_MATMUL_QT;
+	j.xout	= xout;
+	j.qt_x	= x;
+	j.qt_w	= w1;
+	j.n	= n;
+	j.d	= d;
 
-	for (m = 0; m < count_threads; m++)
-		clamma_sem_post(&work_threads[m].sem_start);
+	smp_queue(&j);
 
 	return 0;
 }
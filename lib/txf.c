@@ -24,23 +24,179 @@
  * IN THE SOFTWARE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for O_DIRECT */
+#endif
+
 #include "private.h"
 
 static txf_t		*txf_head;
-static txf_session_t	*sess_head;
-#if defined(LIBCLAMMA_SMP)
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
 clamma_mutex_t          mut_sessions;
 #endif
 
+/*
+ * Sessions with an active query are on exactly one of these run queues,
+ * protected by mut_sessions.  Picking the next session and removing any
+ * session are both O(1) regardless of how many sessions exist.
+ *
+ * They're process-wide rather than per transformer, because the stepping apis
+ * don't take a transformer... clamma_sessions_step_next() steps the sessions
+ * of all transformers in turn.  mut_sessions is process-wide with them, since
+ * releasing memory on a transformer's budget moves its waiting sessions onto
+ * the run queues.
+ *
+ * Sessions submitted to the engine have their own set of run queues, so only
+ * the engine thread picks them, and it doesn't pick the application's.
+ */
+
+typedef struct sched_queues {
+	clamma_dll2_owner_t	prefill;
+	clamma_dll2_owner_t	decode;
+	clamma_dll2_owner_t	finished;
+	unsigned int		flip; /* alternates prefill / decode */
+} sched_queues_t;
+
+static sched_queues_t sched[2]; /* [0] stepped by the app, [1] by the engine */
+
+static clamma_dll2_owner_t *
+sched_queue(const txf_session_t *ts, clamma_sess_state_t state)
+{
+	sched_queues_t *q = &sched[!!ts->engine];
+
+	switch (state) {
+	case CLAMMA_SESS_PREFILL:
+		return &q->prefill;
+	case CLAMMA_SESS_DECODE:
+		return &q->decode;
+	case CLAMMA_SESS_FINISHED:
+		return &q->finished;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Dequantize n values of qx starting at value ofs into x.  The quantized values
+ * and scales are read out of the model DQ_GROUPS groups at a time, so it works
+ * the same whatever the model access.
+ */
+
+#define DQ_GROUPS 256
+
+static int
+dequantize(const txf_t *t, const qt_t *qx, size_t ofs, float *x, size_t n)
+{
+	size_t gs = t->c.group_size, g, k, groups = n / gs, g0 = ofs / gs;
+	float w_s[DQ_GROUPS];
+	cq_t *w_q;
+
+	w_q = malloc((groups < DQ_GROUPS ? groups : DQ_GROUPS) * gs);
+	if (!w_q)
+		return 1;
+
+	for (g = 0; g < groups; g += k) {
+		k = groups - g < DQ_GROUPS ? groups - g : DQ_GROUPS;
+		if (clamma_weight_read(t, w_q, qx->q + (g0 + g) * gs, k * gs) ||
+		    clamma_weight_read(t, w_s, qx->s + g0 + g,
+				       k * sizeof(float))) {
+			free(w_q);
+			return 1;
+		}
+
+		for (size_t i = 0; i < k * gs; i++)
+			x[g * gs + i] = (float)w_q[i] * w_s[i / gs];
+	}
+
+	free(w_q);
+
+	return 0;
+}
+
+/*
+ * Fill x with the embedding row for token.  Float models have the table in the
+ * model, int8 ones only keep it quantized, and we dequantize the one row the
+ * forward needs, via the hot row cache if there is one.
+ */
+
+int
+clamma_txf_embedding(const txf_t *t, float *x, tok_id_t token)
+{
+	emb_cache_t *emb = (emb_cache_t *)&t->emb;
+	size_t dim = t->c.dim;
+	unsigned int slot;
+	int hit = 0;
+
+	if (t->c.version == CLAMMA_MODEL_VERSION1_FLOAT)
+		return clamma_weight_read(t, x, t->w.token_embedding_table +
+					  (size_t)token * dim,
+					  dim * sizeof(*x));
+
+	if (!emb->count)
+		return dequantize(t, t->w.q_tokens, (size_t)token * dim, x, dim);
+
+	slot = (unsigned int)token % emb->count;
+
+	clamma_mutex_lock(&emb->mut);
+	if (emb->tag[slot] == token) {
+		memcpy(x, emb->rows + (size_t)slot * dim, dim * sizeof(*x));
+		hit = 1;
+	}
+	clamma_mutex_unlock(&emb->mut);
+
+	if (hit)
+		return 0;
+
+	/* don't hold the lock while the row may be read from the model */
+
+	if (dequantize(t, t->w.q_tokens, (size_t)token * dim, x, dim))
+		return 1;
+
+	clamma_mutex_lock(&emb->mut);
+	memcpy(emb->rows + (size_t)slot * dim, x, dim * sizeof(*x));
+	emb->tag[slot] = token;
+	clamma_mutex_unlock(&emb->mut);
+
+	return 0;
+}
+
+static int
+emb_cache_create(txf_t *t, unsigned int rows)
+{
+	emb_cache_t *emb = &t->emb;
+
+	if (rows > t->c.vocab_size)
+		rows = t->c.vocab_size;
+
+	emb->rows = malloc((size_t)rows * t->c.dim * sizeof(float));
+	emb->tag = malloc(rows * sizeof(tok_id_t));
+	if (!emb->rows || !emb->tag) {
+		free(emb->rows);
+		free(emb->tag);
+		emb->rows = NULL;
+		emb->tag = NULL;
+		return 1;
+	}
+
+	memset(emb->tag, 0xff, rows * sizeof(tok_id_t)); /* all -1 */
+	emb->count = rows;
+	clamma_mutex_init(&emb->mut);
+
+	return 0;
+}
+
 static void
-dequantize(txf_t *t, qt_t *qx, float *x, int n)
+emb_cache_destroy(txf_t *t)
 {
-	const cq_t *w_q = clamma_weight_cache(t, qx->q, n);
-	const float *w_s = clamma_weight_cache(t, qx->s,
-				(n / t->c.group_size) * sizeof(*w_s));
+	emb_cache_t *emb = &t->emb;
 
-	for (int i = 0; i < n; i++)
-		x[i] = (float)w_q[i] * w_s[i / t->c.group_size];
+	if (!emb->count)
+		return;
+
+	clamma_mutex_destroy(&emb->mut);
+	free(emb->rows);
+	free(emb->tag);
+	emb->count = 0;
 }
 
 static qt_t *
@@ -90,37 +246,507 @@ clamma_txf_by_name(const char *name)
 	return NULL;
 }
 
+/*
+ * The kv cache is allocated per-query, sized for the positions the query may
+ * reach, so it is accounted separately from the rest of the session state
+ */
+
+size_t
+clamma_session_kv_size(const txf_t *t, size_t positions)
+{
+	size_t kvd = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
+
+	return t->c.n_layers * positions * kvd * 2 * sizeof(txi_t);
+}
+
+static size_t
+session_scratch_size(const txf_t *t)
+{
+	size_t n = (t->c.dim * 4) + /* x, xb, xb2, q */
+		   t->c.vocab_size + /* logits */
+		   (t->c.hidden_dim * 2) + /* hb, hb2 */
+		   (t->c.n_heads * t->c.seq_len); /* att */
+
+	switch (t->c.version) {
+	case CLAMMA_MODEL_VERSION2_INT8_80:
+		/* xq and hq, the cq_t parts rounded up to whole txi_t */
+		n += ((t->c.dim + sizeof(txi_t) - 1) / sizeof(txi_t)) +
+		     (t->c.dim / t->c.group_size) +
+		     ((t->c.hidden_dim + sizeof(txi_t) - 1) / sizeof(txi_t)) +
+		     (t->c.hidden_dim / t->c.group_size);
+		break;
+	}
+
+	return n * sizeof(txi_t);
+}
+
+/* the part of the session that exists whether it's querying or not */
+
+static size_t
+session_fixed_size(const txf_t *t)
+{
+	return sizeof(txf_session_t) + session_scratch_size(t) +
+	       (t->c.vocab_size * sizeof(pidx_t));
+}
+
 size_t
 clamma_txf_session_size(const txf_t *t)
 {
-	size_t kvd  = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
-	size_t size = (((t->c.dim       * 2) +
-		(t->c.vocab_size) +
-		(t->c.n_layers   * t->c.seq_len * kvd * 2) +
-		(t->c.n_layers    * t->c.seq_len)) * sizeof(txi_t));
+	return session_fixed_size(t) + clamma_session_kv_size(t, t->c.seq_len);
+}
+
+/*
+ * Must hold mut_sessions.  Reserve bytes against the txf memory budget, if
+ * any, returns 0 if reserved or 1 if there isn't enough headroom.
+ */
+
+static int
+txf_mem_reserve(txf_t *t, size_t bytes)
+{
+	if (t->mem_budget && t->mem_reserved + bytes > t->mem_budget)
+		return 1;
+
+	t->mem_reserved += bytes;
+
+	return 0;
+}
+
+/*
+ * Must hold mut_sessions.  Return reserved bytes to the txf budget, and admit
+ * as many queries that were waiting for memory as now fit, in order.
+ */
+
+static void
+txf_mem_release(txf_t *t, size_t bytes)
+{
+	assert(t->mem_reserved >= bytes);
+	t->mem_reserved -= bytes;
+
+	while (t->mem_waiting.head) {
+		txf_session_t *ts = clamma_container_of(t->mem_waiting.head,
+							txf_session_t, list);
+		size_t kv = clamma_session_kv_size(t, ts->kv_len);
+
+		if (txf_mem_reserve(t, kv))
+			break;
+
+		ts->kv_reserved = kv;
+		clamma_dll2_remove(&ts->list);
+		ts->state = CLAMMA_SESS_PREFILL;
+		clamma_dll2_add_tail(&ts->list, sched_queue(ts, ts->state));
+		clamma_engine_kick();
+	}
+}
+
+size_t
+clamma_txf_headroom(const txf_t *t)
+{
+	size_t h = SIZE_MAX;
+
+	clamma_mutex_lock(&mut_sessions);
+	if (t->mem_budget)
+		h = t->mem_budget - t->mem_reserved;
+	clamma_mutex_unlock(&mut_sessions);
+
+	return h;
+}
+
+/*
+ * Allocate and lay out a session's buffers.  If kv_positions is nonzero, the
+ * kv cache is allocated now for that many positions, otherwise it's left to be
+ * allocated when the session is stepped.
+ */
+
+static txf_session_t *
+session_alloc(const txf_t *t, size_t kv_positions)
+{
+	txf_session_state_t *tss;
+	txf_session_t *ts;
+	size_t size;
+	float *fp;
+
+	ts = malloc(sizeof(*ts));
+	if (!ts)
+		return NULL;
+
+	memset(ts, 0, sizeof(*ts));
+
+	ts->t = t;
+
+	// buffer only used with nucleus sampling; may not need but it's ~small
+	ts->sampler.probindex   = malloc(t->c.vocab_size * sizeof(pidx_t));
+	if (!ts->sampler.probindex)
+		goto bail1;
+
+	size = session_scratch_size(t);
+
+	ts->s.x = malloc(size);
+	if (!ts->s.x)
+		goto bail2;
+
+	memset(ts->s.x, 0, size);
+
+	if (kv_positions) {
+		size = clamma_session_kv_size(t, kv_positions);
+		ts->s.key_cache = malloc(size);
+		if (!ts->s.key_cache)
+			goto bail3;
+
+		memset(ts->s.key_cache, 0, size);
+		ts->s.value_cache = ts->s.key_cache +
+					(size / (2 * sizeof(txi_t)));
+		ts->kv_len = kv_positions;
+	}
+
+	fp = ts->s.x + t->c.dim;
+	ts->s.logits      = fp;
+	fp += t->c.vocab_size;
+	tss = &ts->s.tss;
+
+	tss->t = t;
+	if (clamma_smp_tss_init(tss))
+		goto bail4;
+
+	tss->xb   = fp;
+	fp += t->c.dim;
+	tss->xb2  = fp;
+	fp += t->c.dim;
+	tss->hb   = fp;
+	fp += t->c.hidden_dim;
+	tss->hb2  = fp;
+	fp += t->c.hidden_dim;
+	tss->q    = fp;
+	fp += t->c.dim;
+	tss->att  = fp;
+	fp += t->c.n_heads  * t->c.seq_len;
 
 	switch (t->c.version) {
 	case CLAMMA_MODEL_VERSION2_INT8_80:
-		size += sizeof(txi_t) * (t->c.vocab_size +
-					 t->c.dim + t->c.dim +
-					 t->c.hidden_dim);
+		tss->xq.q = (cq_t *)fp;
+		fp += (t->c.dim + sizeof(txi_t) - 1) / sizeof(txi_t);
+		tss->xq.s = fp;
+		fp += t->c.dim / t->c.group_size;
+		tss->hq.q = (cq_t *)fp;
+		fp += (t->c.hidden_dim + sizeof(txi_t) - 1) / sizeof(txi_t);
+		tss->hq.s = fp;
+		fp += t->c.hidden_dim / t->c.group_size;
 		break;
 	}
 
-	size += 1 * sizeof(float) *
-		((t->c.dim * 5) + (t->c.hidden_dim * 4) +
-		 (t->c.n_layers * t->c.seq_len)) +
-		 (1 * (t->c.dim + t->c.hidden_dim));
+	ts->state = CLAMMA_SESS_IDLE;
+
+	return ts;
+
+bail4:
+	free(ts->s.key_cache);
+bail3:
+	free(ts->s.x);
+bail2:
+	free(ts->sampler.probindex);
+bail1:
+	free(ts);
+
+	return NULL;
+}
+
+static void
+session_free(txf_session_t *ts)
+{
+	clamma_smp_tss_deinit(&ts->s.tss);
+
+	free(ts->tokens);
+	free(ts->sampler.probindex);
+	free(ts->s.key_cache);
+	free(ts->s.x);
+
+	free(ts);
+}
+
+/*
+ * Return a pooled session to the state it was in when it was preallocated,
+ * without reallocating anything.  Only the kv cache rows a query may have
+ * written, 0..pos in each layer, need clearing.
+ */
+
+static void
+session_reset(txf_session_t *ts)
+{
+	const txf_t *t = ts->t;
+	size_t kvd = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
+	       rows = ts->pos < ts->kv_len ? ts->pos : ts->kv_len;
+
+	if (rows)
+		for (uint32_t l = 0; l < t->c.n_layers; l++) {
+			size_t loff = l * ts->kv_len * kvd;
+
+			memset(ts->s.key_cache + loff, 0,
+			       rows * kvd * sizeof(txi_t));
+			memset(ts->s.value_cache + loff, 0,
+			       rows * kvd * sizeof(txi_t));
+		}
+
+	free(ts->tokens);
+	ts->tokens		= NULL;
+	ts->pos			= 0;
+	ts->limit		= 0;
+	ts->ct			= 0;
+	ts->token		= 0;
+	ts->tnext		= 0;
+	ts->token_count		= 0;
+	ts->start		= 0;
+	ts->issue_cb		= NULL;
+	ts->opaque_user_pointer	= NULL;
+	ts->null_on_destroy	= NULL;
+	ts->client_gone		= 0;
+	ts->state		= CLAMMA_SESS_IDLE;
+}
+
+/*
+ * Preallocate count sessions, including a kv cache for the full model seq_len,
+ * on the txf's free pool.  Their memory is reserved against the budget for
+ * the lifetime of the txf.
+ */
+
+static int
+txf_pool_create(txf_t *t, unsigned int count)
+{
+	size_t each = session_fixed_size(t) +
+		      clamma_session_kv_size(t, t->c.seq_len);
+	txf_session_t *ts;
+
+	while (count--) {
+		if (txf_mem_reserve(t, each)) {
+			fprintf(stderr, "%s: session pool exceeds mem_budget\n",
+					__func__);
+			return 1;
+		}
+
+		ts = session_alloc(t, t->c.seq_len);
+		if (!ts) {
+			txf_mem_release(t, each);
+			return 1;
+		}
+
+		ts->pooled = 1;
+		clamma_dll2_add_tail(&ts->list, &t->pool_free);
+		t->pool_reserved += each;
+		t->count_pooled++;
+	}
+
+	return 0;
+}
+
+static void
+txf_pool_destroy(txf_t *t)
+{
+	clamma_dll2_t *d;
+
+	while ((d = clamma_dll2_pop_head(&t->pool_free)))
+		session_free(clamma_container_of(d, txf_session_t, list));
+}
+
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
 
-	return size;
+/*
+ * Thread count tuning: we time a few forwards at 1, 2, 4... threads up to the
+ * max, and keep whichever was fastest.  The result can be cached in a file,
+ * one "key threads" line per model and host, so later constructs skip it.
+ */
+
+#define TUNE_WARMUP		1
+#define TUNE_POSITIONS		3
+
+static void
+txf_tune_key(const txf_t *t, const clamma_txf_info_t *info, char *key,
+	     size_t len)
+{
+	const char *name = info->checkpoint_path ? info->checkpoint_path : "-",
+		   *sl = strrchr(name, '/');
+	char host[64];
+	long cpus = 0;
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "-");
+	host[sizeof(host) - 1] = '\0';
+#if defined(_SC_NPROCESSORS_ONLN)
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	snprintf(key, len, "%s/%llu/%d@%s/%ld/%s/%s", sl ? sl + 1 : name,
+		 (unsigned long long)t->file_size, (int)t->c.version, host,
+		 cpus, info->cpus ? info->cpus : "-", LIBCLAMMA_THREAD_MODEL);
+}
+
+static unsigned int
+txf_tune_cached(const char *path, const char *key)
+{
+	char line[384], k[320];
+	unsigned int n, found = 0;
+	FILE *f;
+
+	if (!path)
+		return 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	/* the last entry for the key wins */
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "%319s %u", k, &n) == 2 && !strcmp(k, key) &&
+		    n && n <= LIBCLAMMA_MAX_THREADS)
+			found = n;
+
+	fclose(f);
+
+	return found;
+}
+
+static uint64_t
+txf_tune_time(txf_session_t *ts)
+{
+	uint64_t start = 0;
+	int pos;
+
+	for (pos = 0; pos < TUNE_WARMUP + TUNE_POSITIONS; pos++) {
+		if (pos == TUNE_WARMUP)
+			start = clamma_timestamp_ns();
+		clamma_session_forward(ts, 1, TOK_BOS, pos);
+	}
+
+	return clamma_timestamp_ns() - start;
 }
 
+/*
+ * Returns the thread count to use and leaves t using it.  *how is set to
+ * describe where it came from.
+ *
+ * Each pool calibrates its cost model when it's made, so we make one per
+ * count we try, starting from the one t was constructed with, and keep the
+ * best one so far aside rather than making it again at the end.
+ */
+
+static unsigned int
+txf_tune_threads(txf_t *t, const clamma_txf_info_t *info,
+		 const clamma_cpuset_t *cs, unsigned int threads,
+		 const char **how)
+{
+	struct clamma_pool *first = t->pool, *keep = NULL, *p;
+	unsigned int max = info->threads, n, best = threads;
+	uint64_t ns, best_ns = ~0ull;
+	txf_session_t *ts;
+	size_t reserved;
+	char key[320];
+	FILE *f;
+
+	*how = "";
+
+	if (!info->tune_threads || (info->pool_name && info->pool_name[0]))
+		/* not asked for, or the pool isn't ours to resize */
+		return threads;
+
+	txf_tune_key(t, info, key, sizeof(key));
+	n = txf_tune_cached(info->tune_cache, key);
+	if (n) {
+		*how = " (tuned, cached)";
+		if (n == threads)
+			return threads;
+		best = n;
+		goto set;
+	}
+
+	if (!max) {
+		max = LIBCLAMMA_MAX_THREADS;
+#if defined(_SC_NPROCESSORS_ONLN)
+		if (sysconf(_SC_NPROCESSORS_ONLN) > 0 &&
+		    sysconf(_SC_NPROCESSORS_ONLN) < max)
+			max = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (max > LIBCLAMMA_MAX_THREADS)
+		max = LIBCLAMMA_MAX_THREADS;
+
+	/* the tuning session counts against the budget like any other */
+
+	reserved = session_fixed_size(t) +
+		   clamma_session_kv_size(t, TUNE_WARMUP + TUNE_POSITIONS);
+	if (txf_mem_reserve(t, reserved)) {
+		fprintf(stderr, "%s: no mem_budget left to tune in\n",
+				__func__);
+		return threads;
+	}
+
+	ts = session_alloc(t, TUNE_WARMUP + TUNE_POSITIONS);
+	if (!ts) {
+		txf_mem_release(t, reserved);
+		return threads;
+	}
+
+	t->pool = NULL;
+	for (n = 1; n <= max; n = n == max ? max + 1 :
+				(n * 2 > max ? max : n * 2)) {
+		if (n == threads && first) {
+			t->pool = first;
+			first = NULL;
+		} else if (clamma_smp_init(t, n, cs, NULL))
+			break;
+
+		ns = txf_tune_time(ts);
+
+		/* drop whichever of this pool and the best so far lost */
+
+		p = t->pool;
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = n;
+			t->pool = keep;
+			keep = p;
+		}
+		clamma_smp_deinit(t);
+	}
+
+	session_free(ts);
+	txf_mem_release(t, reserved);
+	*how = " (tuned)";
+
+	/* and the one we were constructed with, if we never got to it */
+
+	t->pool = first;
+	clamma_smp_deinit(t);
+	t->pool = keep;
+
+	if (info->tune_cache) {
+		f = fopen(info->tune_cache, "a");
+		if (f) {
+			fprintf(f, "%s %u\n", key, best);
+			fclose(f);
+		}
+	}
+
+	if (keep)
+		return best;
+
+	/* OpenMP has no pools to keep, it just needs to know the count */
+
+set:
+	clamma_smp_deinit(t);
+	if (clamma_smp_init(t, best, cs, NULL))
+		return 0;
+
+	return best;
+}
+
+#endif
+
 txf_t *
 clamma_txf_construct(const clamma_txf_info_t *info)
 {
 	static const char *access_name[] = { "MMAP", "AllocCache", "Address" };
 	int head_size, threads = info->threads ? info->threads : 8;
 	char desc[256], thr[64];
+	const char *tuned = "", *path;
+	clamma_cpuset_t cs;
 	uint32_t *p32 = NULL;
 	uint64_t n_layers;
 	uint8_t buf[256];
@@ -142,8 +768,36 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		return NULL;
 
 	memset(t, 0, sizeof(*t));
+	t->fd_direct = -1;
+
+	if (clamma_cpuset_parse(&cs, info->cpus)) {
+		fprintf(stderr, "%s: bad cpu list %s\n", __func__, info->cpus);
+		free(t);
+		return NULL;
+	}
+	t->numa = info->numa;
+	t->numa_nodes = clamma_numa_nodes(&cs);
+	t->numa_replicate = !!info->numa_replicate;
+
+	/*
+	 * Spinning only helps if the workers aren't competing for cpus with
+	 * each other or the session waiting for them.  The pool's cost model
+	 * is calibrated with it, so it's set before we get the pool.
+	 */
+
+	if (info->spin_us > 0)
+		t->spin_ns = (uint64_t)info->spin_us * 1000;
+#if defined(_SC_NPROCESSORS_ONLN)
+	else if (!info->spin_us && threads < sysconf(_SC_NPROCESSORS_ONLN))
+		t->spin_ns = 50000;
+#endif
+
+	clamma_weight_cache_init(t);
 
-	clamma_smp_init(threads);
+	if (clamma_smp_init(t, threads, &cs, info->pool_name)) {
+		fprintf(stderr, "%s: unable to create threads\n", __func__);
+		goto bail;
+	}
 
 	if (!info->checkpoint_path)
 		return t;
@@ -152,8 +806,10 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 	t->model_base   = info->model_base;
 	t->model_size   = info->model_size;
 	t->cache_limit  = info->cache_limit;
+	t->cache_zlimit = info->cache_compressed_limit;
 	t->model_type   = info->model_type;
 	t->max_sessions = info->max_sessions;
+	t->mem_budget   = info->mem_budget;
 
 	strncpy(t->name, info->name, sizeof(t->name));
 	t->name[sizeof(t->name) - 1] = '\0';
@@ -161,12 +817,14 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
 	case CLAMMA_MODEL_ACCESS_MALLOC_CACHE:
-		t->fd = open(info->checkpoint_path, O_RDONLY);
+		path = info->checkpoint_path;
+		t->fd = open(path, O_RDONLY);
 		if (t->fd < 0) {
 			snprintf(desc, sizeof(desc) - 1, "%s/%s",
 					CLAMMA_MODEL_SEARCH_PATH,
 					info->checkpoint_path);
-			t->fd = open(desc, O_RDONLY);
+			path = desc;
+			t->fd = open(path, O_RDONLY);
 			if (t->fd < 0) {
 				fprintf(stderr, "Couldn't open file %s\n",
 						info->checkpoint_path);
@@ -174,6 +832,17 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 			}
 		}
 
+#if defined(LIBCLAMMA_SMP) && defined(O_DIRECT)
+		if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE &&
+		    info->cache_direct_io) {
+			t->fd_direct = open(path, O_RDONLY | O_DIRECT);
+			if (t->fd_direct < 0)
+				fprintf(stderr, "%s: no O_DIRECT for %s, "
+					"using the page cache\n", __func__,
+					info->checkpoint_path);
+		}
+#endif
+
 		t->file_size = lseek(t->fd, 0, SEEK_END);
 		lseek(t->fd, 0, SEEK_SET);
 		break;
@@ -183,9 +852,7 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
-		t->data = mmap(NULL, t->file_size, PROT_READ, MAP_PRIVATE,
-			       t->fd, 0);
-		if (t->data == MAP_FAILED) {
+		if (clamma_mmap_model(t, info->mmap_flags)) {
 			fprintf(stderr, "MMAP failed %s\n",
 					info->checkpoint_path);
 			goto bail1;
@@ -207,6 +874,10 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		break;
 	}
 
+	if (t->numa_replicate &&
+	    t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE)
+		clamma_numa_replicate(t);
+
 	if (p32[0] == 0x616b3432 && p32[1] == 2) {
 		uint8_t *p = (uint8_t *)&p32[9];
 
@@ -236,35 +907,8 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 	if (clamma_vocab_construct(t, info->tokenizer_path))
 		goto bail2;
 
-#if defined(LIBCLAMMA_SMP)
-	snprintf(thr, sizeof(thr) - 1, "%u x ", threads);
-#else
-	thr[0] = '\0';
-#endif
-
-	size = clamma_txf_session_size(t);
-	snprintf(desc, sizeof(desc) - 1,
-		       "☙ Clamma ❧  %s%s, model: %s (%uMB) %s %s, "
-			"vocab: %u (%uKB),\n"
-		       "             Session: %llu.%03lluMB, d: %u, hd: %u, "
-			"l: %u, h: %d, kvh: %d, seq_len: %d",
-		       thr, LIBCLAMMA_THREAD_MODEL, info->checkpoint_path,
-		       (unsigned int)(t->file_size / (1024 * 1024)),
-		       t->c.version ? "int8" : "float",
-		       access_name[t->model_access], t->c.vocab_size,
-		       (int)(t->v.storage_size / 1024),
-		       ((unsigned long long)size) / (1024 * 1024),
-		       	(((unsigned long long)size) % (1024 * 1024)) / 1000,
-		       t->c.dim, t->c.hidden_dim, t->c.n_layers, t->c.n_heads,
-		       t->c.n_kv_heads, t->c.seq_len);
-
-	if (info->desc && info->desc_max) {
-		strncpy(info->desc, desc, info->desc_max);
-		info->desc[info->desc_max - 1] = '\0';
-	}
-
-	fprintf(stderr, "%s\n", desc);
-	fflush(stderr);
+	if (txf_pool_create(t, info->session_pool))
+		goto bail2a;
 
 	/*
 	 * Layout the structure of the model file
@@ -324,16 +968,12 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		if (!t->w.q_tokens)
 			goto bail2a;
 
-		/* dequantize token embedding table */
+		/* the embedding rows are dequantized as they're needed */
 
-		t->w.token_embedding_table = malloc(t->c.vocab_size *
-						t->c.dim * sizeof(float));
-		if (!t->w.token_embedding_table)
+		if (info->embed_cache_rows &&
+		    emb_cache_create(t, info->embed_cache_rows))
 			goto bail3;
 
-		dequantize(t, t->w.q_tokens, t->w.token_embedding_table,
-				t->c.vocab_size * t->c.dim);
-
 		t->w.wq = init_quantized_tensors(t, &wp, t->c.n_layers,
 				t->c.dim * (t->c.n_heads * head_size));
 		if (!t->w.wq)
@@ -377,8 +1017,54 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		goto bail2a;
 	}
 
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
+	threads = txf_tune_threads(t, info, &cs, threads, &tuned);
+	if (!threads) {
+		fprintf(stderr, "%s: unable to create threads\n", __func__);
+		goto bail12;
+	}
+
+	snprintf(thr, sizeof(thr) - 1, "%u x ", threads);
+#else
+	thr[0] = '\0';
+#endif
+
+	clamma_weight_prefetch_start(t);
+
+	size = clamma_txf_session_size(t);
+	snprintf(desc, sizeof(desc) - 1,
+		       "☙ Clamma ❧  %s%s%s, model: %s (%uMB) %s %s, "
+			"vocab: %u (%uKB),\n"
+		       "             Session: %llu.%03lluMB, d: %u, hd: %u, "
+			"l: %u, h: %d, kvh: %d, seq_len: %d",
+		       thr, LIBCLAMMA_THREAD_MODEL, tuned, info->checkpoint_path,
+		       (unsigned int)(t->file_size / (1024 * 1024)),
+		       t->c.version ? "int8" : "float",
+		       access_name[t->model_access], t->c.vocab_size,
+		       (int)(t->v.storage_size / 1024),
+		       ((unsigned long long)size) / (1024 * 1024),
+		       	(((unsigned long long)size) % (1024 * 1024)) / 1000,
+		       t->c.dim, t->c.hidden_dim, t->c.n_layers, t->c.n_heads,
+		       t->c.n_kv_heads, t->c.seq_len);
+
+	if (info->desc && info->desc_max) {
+		strncpy(info->desc, desc, info->desc_max);
+		info->desc[info->desc_max - 1] = '\0';
+	}
+
+	fprintf(stderr, "%s\n", desc);
+	fflush(stderr);
+
 	return t;
 
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
+bail12:
+	/* only the int8 layout allocated anything for the weights */
+	if (t->c.version != CLAMMA_MODEL_VERSION2_INT8_80)
+		goto bail2a;
+	if (!t->c.shared_classifier)
+		free(t->w.wcls);
+#endif
 bail11:
 	free(t->w.w3);
 bail10:
@@ -394,24 +1080,28 @@ bail6:
 bail5:
 	free(t->w.wq);
 bail4:
-	free(t->w.token_embedding_table);
+	emb_cache_destroy(t);
 bail3:
 	free(t->w.q_tokens);
 bail2a:
+	txf_pool_destroy(t);
 	clamma_vocab_destroy(t);
 bail2:
+	clamma_numa_replicas_free(t);
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
-		if (t->data != MAP_FAILED)
-			munmap(t->data, t->file_size);
+		clamma_mmap_unmap(t);
 		break;
 	default:
 		break;
 	}
 bail1:
+	if (t->fd_direct >= 0)
+		close(t->fd_direct);
 	close(t->fd);
 bail:
-	clamma_smp_deinit();
+	clamma_weight_cache_deinit(t);
+	clamma_smp_deinit(t);
 	free(t);
 
 	return NULL;
@@ -420,14 +1110,18 @@ bail:
 void
 clamma_txf_destroy(txf_t *t)
 {
-	clamma_smp_deinit();
+	/* the prefetch thread may be reading the model */
+	clamma_weight_prefetch_stop(t);
+	clamma_smp_deinit(t);
+	clamma_numa_replicas_free(t);
 
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
-		if (t->data != MAP_FAILED)
-			munmap(t->data, t->file_size);
+		clamma_mmap_unmap(t);
 		/* fallthru */
 	case CLAMMA_MODEL_ACCESS_MALLOC_CACHE:
+		if (t->fd_direct >= 0)
+			close(t->fd_direct);
 		if (t->fd != -1)
 			close(t->fd);
 		break;
@@ -435,14 +1129,22 @@ clamma_txf_destroy(txf_t *t)
 		break;
 	}
 
-	switch (t->model_access) {
-	case CLAMMA_MODEL_ACCESS_MALLOC_CACHE:
-		clamma_weight_cache_clear();
-		break;
-	default:
-		break;
+	if (t->c.version == CLAMMA_MODEL_VERSION2_INT8_80) {
+		if (!t->c.shared_classifier)
+			free(t->w.wcls);
+		free(t->w.w3);
+		free(t->w.w2);
+		free(t->w.w1);
+		free(t->w.wo);
+		free(t->w.wv);
+		free(t->w.wk);
+		free(t->w.wq);
+		emb_cache_destroy(t);
+		free(t->w.q_tokens);
 	}
 
+	clamma_weight_cache_deinit(t);
+	txf_pool_destroy(t);
 	clamma_vocab_destroy(t);
 
 	free(t);
@@ -461,117 +1163,68 @@ clamma_timestamp_ns(void)
 txf_session_t *
 clamma_session_construct(const txf_t *t)
 {
-	txf_session_state_t *tss;
-	unsigned int count_sessions = 0;
+	/* the txf is otherwise const for sessions, except this accounting */
+	txf_t *tm = (txf_t *)t;
+	size_t fixed = session_fixed_size(t);
 	txf_session_t *ts;
-	size_t kvd, size;
-	float *fp;
+	clamma_dll2_t *d;
 
-	/* limit sessions on this txf to its maximum, if any */
+	/*
+	 * limit sessions on this txf to its maximum, if any, then take a
+	 * preallocated session from the pool if there is one.  Otherwise
+	 * reserve the fixed part of a new session against its memory budget,
+	 * if any, and allocate it.
+	 */
 
-	if (t->max_sessions) {
-#if defined(LIBCLAMMA_SMP)
-		clamma_mutex_lock(&mut_sessions);
-#endif
-		ts = sess_head;
-		while (ts) {
-			if (ts->t == t)
-				count_sessions++;
-			ts = ts->next;
-		}
-#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&mut_sessions);
+	if (t->max_sessions && t->count_sessions >= t->max_sessions) {
 		clamma_mutex_unlock(&mut_sessions);
-#endif
-
-		if (count_sessions >= t->max_sessions) {
-			fprintf(stderr, "%s: reached max sessions %u\n",
-					__func__, count_sessions);
-
-			return NULL;
-		}
-	}
+		fprintf(stderr, "%s: reached max sessions %u\n",
+				__func__, t->count_sessions);
 
-	ts = malloc(sizeof(*ts));
-	if (!t)
 		return NULL;
+	}
 
-	memset(ts, 0, sizeof(*ts));
-
-	ts->t = t;
-
-	// buffer only used with nucleus sampling; may not need but it's ~small
-	ts->sampler.probindex   = malloc(t->c.vocab_size * sizeof(pidx_t));
-	if (!ts->sampler.probindex)
-		goto bail1;
-
-	kvd  = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
-	size = clamma_txf_session_size(t);
-
-	ts->s.x = malloc(size);
-	if (!ts->s.x)
-		goto bail2;
-
-	memset(ts->s.x, 0, size);
-
-	fp = ts->s.x + t->c.dim;
-	ts->s.key_cache   = fp;
-	fp += t->c.n_layers * t->c.seq_len * kvd;
-	ts->s.value_cache = fp;
-	fp += t->c.n_layers * t->c.seq_len * kvd;
-	ts->s.logits      = fp;
-	tss = &ts->s.tss;
-
-	tss->t = t;
-	if (clamma_smp_tss_init(tss))
-		goto bail3;
+	d = clamma_dll2_pop_head(&tm->pool_free);
+	if (d) {
+		tm->count_sessions++;
+		clamma_mutex_unlock(&mut_sessions);
 
-	tss->xb   = fp;
-	fp += t->c.dim;
-	tss->xb2  = fp;
-	fp += t->c.dim;
-	tss->hb   = fp;
-	fp += t->c.hidden_dim;
-	tss->hb2  = fp;
-	fp += t->c.hidden_dim;
-	tss->q    = fp;
-	fp += t->c.dim;
+		return clamma_container_of(d, txf_session_t, list);
+	}
 
-	tss->xq.q = (cq_t *)fp;
-	fp += t->c.dim / sizeof(txi_t);
-	tss->xq.s = fp;
-	fp += t->c.dim;
-	tss->hq.q = (cq_t *)fp;
-	fp += t->c.hidden_dim / sizeof(txi_t);
-	tss->hq.s = fp;
-	fp += t->c.hidden_dim / sizeof(txi_t);
-	tss->att  = fp;
-	fp += t->c.n_heads  * t->c.seq_len;
+	if (txf_mem_reserve(tm, fixed)) {
+		clamma_mutex_unlock(&mut_sessions);
+		fprintf(stderr, "%s: memory budget exhausted\n", __func__);
 
-	clamma_mutex_lock(&mut_sessions);
-	ts->next = sess_head;
-	sess_head = ts;
+		return NULL;
+	}
+	tm->count_sessions++;
 	clamma_mutex_unlock(&mut_sessions);
 
-	return ts;
+	/* the kv cache is allocated when the session is stepped */
 
-bail3:
-	free(ts->s.x);
-bail2:
-	free(ts->sampler.probindex);
-bail1:
-	free(ts);
+	ts = session_alloc(t, 0);
+	if (!ts) {
+		clamma_mutex_lock(&mut_sessions);
+		tm->count_sessions--;
+		txf_mem_release(tm, fixed);
+		clamma_mutex_unlock(&mut_sessions);
+	}
 
-	return NULL;
+	return ts;
 }
 
 void
 clamma_session_destroy(struct txf_session *ts)
 {
+	txf_t *t;
 	uint64_t ns;
 
 	if (!ts)
 		return;
 
+	t = (txf_t *)ts->t;
 	ns = (clamma_timestamp_ns() - ts->start) / 1000000l;
 
 	fprintf(stderr, "\n%s: %p: Session: %lu tokens, tok/s: %4.03f\n",
@@ -579,48 +1232,77 @@ clamma_session_destroy(struct txf_session *ts)
 			(unsigned long)ts->token_count,
 			(float)(ts->token_count * 1000ull) / (ns ? ns : 1));
 
-	/* remove us from the list of sessions */
+	/*
+	 * remove us from any run queue and the txf's session accounting...
+	 * pooled sessions keep their memory reserved while they're pooled
+	 */
 
 	clamma_mutex_lock(&mut_sessions);
-	if (sess_head == ts)
-		sess_head = ts->next;
-	else {
-		struct txf_session *ts1 = sess_head, *ts2 = NULL;
-		while (ts1->next) {
-			ts2 = ts1;
-			ts1 = ts1->next;
-		}
-
-		if (ts2)
-			ts2->next = ts1->next;
-	}
+	clamma_dll2_remove(&ts->list);
+	t->count_sessions--;
+	txf_mem_release(t, (ts->pooled ? 0 : session_fixed_size(t)) +
+			   ts->kv_reserved);
+	ts->kv_reserved = 0;
 	clamma_mutex_unlock(&mut_sessions);
 
 	if (ts->null_on_destroy)
 		*ts->null_on_destroy = NULL;
 
-	clamma_smp_tss_deinit(&ts->s.tss);
-
-	if (ts->tokens) {
-		free(ts->tokens);
-		ts->tokens = NULL;
+	if (ts->engine) {
+		clamma_engine_session_gone(ts);
+		ts->engine = 0;
 	}
 
-	free(ts->sampler.probindex);
-	free(ts->s.x);
+	if (ts->pooled) {
+		session_reset(ts);
 
-	free(ts);
+		clamma_mutex_lock(&mut_sessions);
+		clamma_dll2_add_head(&ts->list, &t->pool_free);
+		clamma_mutex_unlock(&mut_sessions);
+
+		return;
+	}
+
+	session_free(ts);
 }
 
 int
-clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
+_session_query(txf_session_t *ts, const clamma_txf_info_t *info, char engine)
 {
+	txf_t *t = (txf_t *)ts->t;
 	size_t limit = info->limit;
+	size_t size, kv, per_pos, perm;
+	unsigned int unpooled;
 	char desc[256];
-	size_t size;
 	int ret = 1;
 	char *total;
 
+	/*
+	 * Drop anything left from a previous query on this session, including
+	 * its kv cache and the reservation for it
+	 */
+
+	clamma_mutex_lock(&mut_sessions);
+	clamma_dll2_remove(&ts->list);
+	ts->state = CLAMMA_SESS_IDLE;
+	if (ts->kv_reserved) {
+		txf_mem_release(t, ts->kv_reserved);
+		ts->kv_reserved = 0;
+	}
+	clamma_mutex_unlock(&mut_sessions);
+
+	/* undrained output from an earlier engine query is stale now */
+	if (ts->engine)
+		clamma_engine_session_gone(ts);
+	ts->engine = engine;
+
+	if (!ts->pooled) {
+		free(ts->s.key_cache);
+		ts->s.key_cache = ts->s.value_cache = NULL;
+	}
+	free(ts->tokens);
+	ts->tokens = NULL;
+
 	if (!info->limit || (uint32_t)info->limit > ts->t->c.seq_len)
 		limit = ts->t->c.seq_len;
 
@@ -669,9 +1351,6 @@ clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
 	fprintf(stderr, "%s", desc);
 	fflush(stderr);
 
-	if (info->prompt && info->prompt[0])
-		clamma_session_issue(ts, info->prompt);
-
 	ts->tokens = clamma_vocab_encode(ts->t, total ? total : "", 1, 0,
 					 &ts->ct);
 	free(total);
@@ -684,104 +1363,364 @@ clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
 	ts->start = clamma_timestamp_ns();
 	ts->token_count = 0;
 
+	/*
+	 * Admission: reserve the kv cache for the positions this query may
+	 * reach against the txf memory budget.  If there's not enough, we
+	 * either reject the query, shrink its limit to what fits, or leave it
+	 * waiting until enough memory is released by other sessions.
+	 */
+
+	per_pos = clamma_session_kv_size(t, 1);
+
+	clamma_mutex_lock(&mut_sessions);
+	if (ts->pooled) {
+		/* pooled sessions have a full kv cache reserved already */
+		ts->state = CLAMMA_SESS_PREFILL;
+		clamma_dll2_add_tail(&ts->list, sched_queue(ts, ts->state));
+		clamma_mutex_unlock(&mut_sessions);
+		goto queued;
+	}
+
+	kv = clamma_session_kv_size(t, ts->limit);
+	if (!txf_mem_reserve(t, kv)) {
+		ts->kv_reserved = kv;
+		ts->state = CLAMMA_SESS_PREFILL;
+		goto admitted;
+	}
+
+	switch (info->admission) {
+	case CLAMMA_ADMIT_SHRINK:
+		/* the prompt must fit with room for at least one new token */
+		if ((t->mem_budget - t->mem_reserved) / per_pos <= ts->ct)
+			break;
+		ts->limit = (t->mem_budget - t->mem_reserved) / per_pos;
+		kv = clamma_session_kv_size(t, ts->limit);
+		if (txf_mem_reserve(t, kv))
+			break;
+		ts->kv_reserved = kv;
+		ts->state = CLAMMA_SESS_PREFILL;
+		goto admitted;
+
+	case CLAMMA_ADMIT_QUEUE:
+		/*
+		 * It must be able to fit when the other kv caches are gone...
+		 * but the pool keeps its whole reservation for the life of
+		 * the txf, and unpooled sessions keep their fixed part
+		 */
+		unpooled = t->count_sessions -
+			   (t->count_pooled - t->pool_free.count);
+		perm = t->pool_reserved + session_fixed_size(t) * unpooled;
+		if (perm > t->mem_budget || kv > t->mem_budget - perm)
+			break;
+		ts->state = CLAMMA_SESS_WAITING;
+		ts->kv_len = ts->limit;
+		clamma_dll2_add_tail(&ts->list, &t->mem_waiting);
+		clamma_mutex_unlock(&mut_sessions);
+		goto queued;
+
+	default:
+		break;
+	}
+	clamma_mutex_unlock(&mut_sessions);
+
+	fprintf(stderr, "%s: query rejected, memory budget exhausted\n",
+			__func__);
+	free(ts->tokens);
+	ts->tokens = NULL;
+
+	goto bail;
+
+admitted:
+	ts->kv_len = ts->limit;
+	clamma_dll2_add_tail(&ts->list, sched_queue(ts, ts->state));
+	clamma_mutex_unlock(&mut_sessions);
+
+queued:
+	if (info->prompt && info->prompt[0])
+		clamma_session_issue(ts, info->prompt);
+
+	clamma_engine_kick();
 	ret = 0;
 
 bail:
 	return ret;
 }
 
+int
+clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
+{
+	return _session_query(ts, info, 0);
+}
+
 void
 clamma_sessions_query_cancel(struct txf_session *ts)
 {
 	ts->client_gone = 1;
+	if (ts->engine)
+		clamma_engine_session_gone(ts);
+
+	/*
+	 * If it's waiting on a run queue, move it to be reaped next time.  If
+	 * it's being stepped right now, the stepper will see client_gone.
+	 */
+
+	clamma_mutex_lock(&mut_sessions);
+	if (ts->list.owner) {
+		clamma_dll2_remove(&ts->list);
+		ts->state = CLAMMA_SESS_FINISHED;
+		clamma_dll2_add_tail(&ts->list, sched_queue(ts, ts->state));
+	}
+	clamma_mutex_unlock(&mut_sessions);
 }
 
-int
-clamma_sessions_step_next(void)
+/*
+ * Must hold mut_sessions.  Takes the next session to step off the app's or
+ * the engine's run queues, finished sessions are reaped first, otherwise we
+ * alternate between prefill and decode sessions when there are both, so
+ * neither can starve the other.
+ */
+
+static txf_session_t *
+sched_pick(int engine)
 {
-	txf_session_t *ts, *ts1 = NULL;
+	sched_queues_t *q = &sched[engine];
+	clamma_dll2_t *d;
+
+	d = clamma_dll2_pop_head(&q->finished);
+	if (!d) {
+		if (q->prefill.count && q->decode.count)
+			d = clamma_dll2_pop_head((q->flip++ & 1) ?
+						 &q->prefill : &q->decode);
+		else
+			d = clamma_dll2_pop_head(q->prefill.count ?
+						 &q->prefill : &q->decode);
+	}
 
-	ts = sess_head;
-	if (!ts) {
-		fprintf(stderr, "no sessions\n");
+	return d ? clamma_container_of(d, txf_session_t, list) : NULL;
+}
+
+/*
+ * Advance the session by one token... returns 1 if the query continues, 0 if
+ * it has reached its end, or -1 if it failed
+ */
+
+static int
+session_step(txf_session_t *ts)
+{
+	bool is_prompt;
+
+	if (ts->client_gone || ts->pos >= ts->limit)
 		return 0;
-	}
 
-	if (ts->client_gone)
-		goto eol;
+	if (!ts->s.key_cache) {
+		/* the reservation for this was made at admission */
+		ts->s.key_cache = malloc(clamma_session_kv_size(ts->t,
+								ts->kv_len));
+		if (!ts->s.key_cache) {
+			fprintf(stderr, "%s: unable to allocate kv cache\n",
+					__func__);
+			return -1;
+		}
 
-	if (ts->pos < ts->limit) {
-		bool is_prompt = ts->pos + 1 < ts->ct;
+		ts->s.value_cache = ts->s.key_cache +
+				(clamma_session_kv_size(ts->t, ts->kv_len) /
+				 (2 * sizeof(txi_t)));
+	}
 
-		ts->tnext = clamma_session_forward(ts, is_prompt,
-						  ts->token, ts->pos++);
+	is_prompt = ts->pos + 1 < ts->ct;
 
-		if (ts->pos >= ts->limit)
-			goto eol;
+	ts->tnext = clamma_session_forward(ts, is_prompt, ts->token, ts->pos++);
 
-		if (!ts->tnext)
-			goto eol;
+	if (ts->pos >= ts->limit)
+		return 0;
 
-		if (is_prompt)
-			ts->tnext = ts->tokens[ts->pos];
-		else {
-			if (ts->tokens) {
-				free(ts->tokens);
-				ts->tokens = NULL;
-			}
+	if (!ts->tnext)
+		return 0;
+
+	if (is_prompt)
+		ts->tnext = ts->tokens[ts->pos];
+	else {
+		if (ts->tokens) {
+			free(ts->tokens);
+			ts->tokens = NULL;
 		}
+	}
 
-		if (ts->tnext == TOK_BOS)
-			goto eol;
+	if (ts->tnext == TOK_BOS)
+		return 0;
 
-		ts->token_count++;
+	ts->token_count++;
 
-		if (!is_prompt)
-			clamma_session_issue(ts,
-					 clamma_vocab_decode(ts->t,
-						ts->token, ts->tnext));
-		if (ts->pos > 5 && ts->tnext == TOK_EOS)
-			goto eol;
+	if (!is_prompt)
+		clamma_session_issue(ts, clamma_vocab_decode(ts->t, ts->token,
+							     ts->tnext, ts->utf8));
+	if (ts->pos > 5 && ts->tnext == TOK_EOS)
+		return 0;
 
+	ts->token = ts->tnext;
+	ts->state = ts->pos + 1 < ts->ct ? CLAMMA_SESS_PREFILL :
+					   CLAMMA_SESS_DECODE;
 
-		ts->token = ts->tnext;
+	return 1;
+}
 
-		/* find the penultimate (ts1) and last (ts) entries
-		 * in the list */
+/*
+ * Put a session that has just been stepped back on the run queue for its
+ * state, so it can be picked again
+ */
 
-		clamma_mutex_lock(&mut_sessions);
-		ts = sess_head;
-		ts1 = NULL;
-		while (ts->next) {
-			ts1 = ts;
-			ts = ts->next;
-		}
+static void
+sched_requeue(txf_session_t *ts)
+{
+	clamma_mutex_lock(&mut_sessions);
+	if (ts->client_gone)
+		ts->state = CLAMMA_SESS_FINISHED;
+	clamma_dll2_add_tail(&ts->list, sched_queue(ts, ts->state));
+	clamma_mutex_unlock(&mut_sessions);
+}
 
-		/* move the last guy to be the head */
-		if (sess_head != ts)
-			ts->next = sess_head; /* new head's next is old head */
-		sess_head = ts;
-		if (ts1)
-			ts1->next = NULL;
+/*
+ * The session's query is over, but the session continues to exist... release
+ * the query's kv cache and its reservation, which may admit other queries
+ * waiting for memory
+ */
 
-		clamma_mutex_unlock(&mut_sessions);
+static void
+session_query_end(txf_session_t *ts)
+{
+	clamma_mutex_lock(&mut_sessions);
+	ts->state = CLAMMA_SESS_IDLE;
+	if (ts->kv_reserved) {
+		txf_mem_release((txf_t *)ts->t, ts->kv_reserved);
+		ts->kv_reserved = 0;
+	}
+	clamma_mutex_unlock(&mut_sessions);
 
-		return 1;
+	if (!ts->pooled) {
+		free(ts->s.key_cache);
+		ts->s.key_cache = ts->s.value_cache = NULL;
 	}
 
+	free(ts->tokens);
+	ts->tokens = NULL;
+}
+
+/*
+ * Pick the next of the app's or the engine's sessions and step it... returns
+ * -1 if there was nothing to step, 1 if the session's query continues, 0 if
+ * it ended, or -2 if it failed and was ended
+ */
 
+int
+clamma_sessions_run_one(int engine)
+{
+	char eos[2] = { TOK_EOS, 0 };
+	txf_session_t *ts;
+	int r;
 
-	return 0;
+	clamma_mutex_lock(&mut_sessions);
+	ts = sched_pick(engine);
+	clamma_mutex_unlock(&mut_sessions);
 
-eol:
-	{
-		char eos[2] = { TOK_EOS, 0 };
+	if (!ts)
+		return -1;
+
+	r = session_step(ts);
+	if (r > 0) {
+		sched_requeue(ts);
+
+		return 1;
+	}
+
+	/*
+	 * A failed query still ends with the EOS, it's the only way the app
+	 * learns these sessions are done with... our return tells the caller
+	 * it failed
+	 */
 
+	r = r < 0 ? -2 : 0;
+
+	if (ts->engine && !ts->client_gone) {
+		/*
+		 * Engine sessions belong to the app until it drains the EOS,
+		 * after which it may destroy or requery the session at once
+		 */
+		session_query_end(ts);
 		clamma_session_issue(ts, eos);
-		clamma_session_destroy(ts);
 
-		return !!sess_head;
+		return r;
+	}
+
+	clamma_session_issue(ts, eos);
+	clamma_session_destroy(ts);
+
+	return r;
+}
+
+int
+clamma_sessions_step_next(void)
+{
+	uint32_t active;
+	int r;
+
+	r = clamma_sessions_run_one(0);
+	if (r == -1) {
+		fprintf(stderr, "no sessions\n");
+		return 0;
+	}
+	if (r < 0)
+		return -1;
+	if (r)
+		return 1;
+
+	clamma_mutex_lock(&mut_sessions);
+	active = sched[0].prefill.count + sched[0].decode.count +
+		 sched[0].finished.count;
+	clamma_mutex_unlock(&mut_sessions);
+
+	return !!active;
+}
+
+int
+clamma_session_step(txf_session_t *ts)
+{
+	char eos[2] = { TOK_EOS, 0 };
+	clamma_dll2_owner_t *q;
+	int r;
+
+	/*
+	 * Take it off its run queue while we step it, so nobody else can pick
+	 * it... if it's not on one, there's no query active or admitted yet,
+	 * or another thread is stepping it right now.
+	 */
+
+	clamma_mutex_lock(&mut_sessions);
+	q = sched_queue(ts, ts->state);
+	if (!q || ts->list.owner != q) {
+		clamma_mutex_unlock(&mut_sessions);
+		return -1;
+	}
+	clamma_dll2_remove(&ts->list);
+	clamma_mutex_unlock(&mut_sessions);
+
+	r = session_step(ts);
+	if (r > 0) {
+		sched_requeue(ts);
+
+		return 1;
+	}
+
+	if (r < 0) {
+		/* not an end of the output, the caller hears it failed */
+		session_query_end(ts);
+
+		return -1;
 	}
+
+	clamma_session_issue(ts, eos);
+	session_query_end(ts);
+
+	return 0;
 }
 
 int
@@ -802,6 +1741,10 @@ clamma_session_issue(const txf_session_t *ts, const char *piece)
 			return 0;
 	}
 
+	if (ts->engine)
+		/* the app collects it later with clamma_engine_drain() */
+		return clamma_engine_buffer((txf_session_t *)ts, piece);
+
 	if (!ts->issue_cb)
 		return 0;
 
@@ -135,11 +135,16 @@ clamma_vocab_destroy(struct txf *t)
 	free(t->v.sorted_vocab);
 }
 
+/*
+ * utf8 is a caller-provided buffer of at least 16 bytes that <0xAB[CD]> style
+ * pieces are converted into, so concurrent sessions don't share one
+ */
+
 const char *
-clamma_vocab_decode(const struct txf *t, int prev_token, int token)
+clamma_vocab_decode(const struct txf *t, int prev_token, int token, char *utf8)
 {
 	const char *piece = t->v.vocab[token];
-	char *p = (char *)&t->v.utf8;
+	char *p = utf8;
 
 	if (prev_token == 1 && piece[0] == ' ')
 		piece++;
@@ -155,7 +160,7 @@ clamma_vocab_decode(const struct txf *t, int prev_token, int token)
 				return piece;
 
 			if (*piece == '>')
-				return t->v.utf8;
+				return utf8;
 
 			if (*piece >= '0' && *piece <= '9')
 				*p = (*p << 4) | ((*piece) - '0');
@@ -175,7 +180,7 @@ clamma_vocab_decode(const struct txf *t, int prev_token, int token)
 			piece++;
 		}
 
-		return t->v.utf8;
+		return utf8;
 	}
 
 	return piece;
@@ -33,107 +33,991 @@
 
 #include "private.h"
 
-static cwc_state_t cwc;
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+#if defined(LIBCLAMMA_WITH_OPENMP)
+#include <sched.h>
+#endif
 
-const void *
-clamma_weight_cache(const txf_t *t, const void *weight, size_t size)
+/*
+ * When the cache is at its limit, new entries go in at the LRU end of the list
+ * except every CWC_BIP_EVERY'th one.  Inference sweeps the same blocks in the
+ * same order every token, which defeats plain LRU when they don't all fit...
+ * each one is evicted just before it's needed again.  This way a stable set of
+ * blocks stays cached and the hit rate degrades in proportion to the limit.
+ */
+
+#define CWC_BIP_EVERY		32
+
+static unsigned int
+cwc_hash(uint64_t ofs)
 {
-	void *ret = NULL;
-	uint64_t ofs;
-	ssize_t ar;
-	cwc_t *c;
+	return (unsigned int)((ofs * 0x9e3779b97f4a7c15ull) >>
+						(64 - CWC_HASH_BITS));
+}
 
-	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE)
-		return weight;
+/*
+ * Take the entry out of the hash and LRU list, so it can't be found any more
+ */
 
-	c = cwc.cwc_head;
-	ofs = (uint64_t)((uint8_t *)weight - ((uint8_t *)t->data));
+static void
+cwc_unlink(cwc_state_t *cwc, cwc_t *c)
+{
+	cwc_t **pc = &cwc->hash[cwc_hash(c->offset)];
 
-#if defined(LIBCLAMMA_SMP)
-	clamma_mutex_lock(&cwc.mut_cwc);
-#endif
+	while (*pc != c)
+		pc = &(*pc)->hnext;
+	*pc = c->hnext;
+
+	clamma_dll2_remove(&c->lru);
+	cwc->cwc_alloced -= c->len;
+}
 
-	while (c) {
-		if (c->offset == ofs && c->len == size) {
-			c->count++;
-			goto hit;
+static void
+cwc_destroy(cwc_state_t *cwc, cwc_t *c)
+{
+	cwc_unlink(cwc, c);
+	free(c);
+}
+
+/*
+ * Drop a pin... entries whose fill failed are already unlinked, and are freed
+ * when the last thread waiting on them lets go
+ */
+
+static void
+cwc_unpin(cwc_t *c)
+{
+	assert(c->pins);
+	if (!--c->pins && c->failed)
+		free(c);
+}
+
+/*
+ * Make room for size more bytes under the limit, evicting from the LRU end.
+ * With a compressed tier, evicted entries go on the victims list instead of
+ * being freed, for whoever evicted them to compress without the lock held.
+ */
+
+static void
+cwc_evict(const txf_t *t, cwc_state_t *cwc, size_t size)
+{
+	clamma_dll2_t *d = cwc->lru.head, *d1;
+	cwc_t *c;
+
+	while (d && cwc->cwc_alloced + size > t->cache_limit) {
+		d1 = d->next;
+		c = clamma_container_of(d, cwc_t, lru);
+		if (!c->pins) {
+			if (t->cache_zlimit) {
+				cwc_unlink(cwc, c);
+				c->hnext = cwc->victims;
+				cwc->victims = c;
+			} else
+				cwc_destroy(cwc, c);
+			cwc->evictions++;
 		}
-		c = c->next;
+		d = d1;
 	}
+}
+
+static cwcz_t *
+cwcz_lookup(cwc_state_t *cwc, uint64_t ofs)
+{
+	cwcz_t *z;
+
+	for (z = cwc->zhash[cwc_hash(ofs)]; z; z = z->hnext)
+		if (z->offset == ofs)
+			return z;
+
+	return NULL;
+}
 
-	if (t->cache_limit)
-		while (cwc.cwc_alloced > t->cache_limit) {
-			c = cwc.cwc_head->next;
-			cwc.cwc_alloced -= cwc.cwc_head->len;
-			free(cwc.cwc_head);
-			cwc.cwc_head = c;
+static void
+cwcz_destroy(cwc_state_t *cwc, cwcz_t *z)
+{
+	cwcz_t **pz = &cwc->zhash[cwc_hash(z->offset)];
+
+	while (*pz != z)
+		pz = &(*pz)->hnext;
+	*pz = z->hnext;
+
+	clamma_dll2_remove(&z->lru);
+	cwc->z_alloced -= sizeof(*z) + z->zlen;
+	free(z);
+}
+
+/*
+ * Find a block in the compressed tier, pinned so it stays while we
+ * decompress it without the lock held.  Blocks we found didn't compress are
+ * remembered with a zlen of 0, they're not returned.
+ */
+
+static cwcz_t *
+cwcz_pin(cwc_state_t *cwc, uint64_t ofs)
+{
+	cwcz_t *z = cwcz_lookup(cwc, ofs);
+
+	if (!z || !z->zlen)
+		return NULL;
+
+	z->pins++;
+	clamma_dll2_remove(&z->lru);
+	clamma_dll2_add_tail(&z->lru, &cwc->zlru);
+
+	return z;
+}
+
+static void
+cwcz_add(const txf_t *t, cwc_state_t *cwc, cwcz_t *z)
+{
+	size_t size = sizeof(*z) + z->zlen;
+	clamma_dll2_t *d = cwc->zlru.head, *d1;
+	unsigned int h = cwc_hash(z->offset);
+
+	while (d && cwc->z_alloced + size > t->cache_zlimit) {
+		d1 = d->next;
+		if (!clamma_container_of(d, cwcz_t, lru)->pins)
+			cwcz_destroy(cwc, clamma_container_of(d, cwcz_t, lru));
+		d = d1;
+	}
+
+	memset(&z->lru, 0, sizeof(z->lru));
+	z->pins = 0;
+	z->hnext = cwc->zhash[h];
+	cwc->zhash[h] = z;
+	clamma_dll2_add_tail(&z->lru, &cwc->zlru);
+	cwc->z_alloced += size;
+}
+
+/*
+ * Compress a list of blocks evicted from the cache into the compressed tier,
+ * and free them.  Called without the lock held, compressing takes a while.
+ * Blocks that don't compress by at least 1/CWCZ_MIN_SAVING aren't worth
+ * keeping, we just remember that so we don't try them again.
+ *
+ * Once the tier is full, it has the same problem with the inference sweep as
+ * the cache, and also each block it turns over costs compressing it... so
+ * then we only take every CWC_BIP_EVERY'th block, the rest are just freed.
+ */
+
+#define CWCZ_MIN_SAVING		16
+
+static void
+cwcz_store(const txf_t *t, cwc_t *v)
+{
+	cwc_state_t *cwc = (cwc_state_t *)&t->cwc;
+	uint8_t *scratch = NULL;
+	size_t zl = 0;
+	cwcz_t *z;
+	cwc_t *c;
+	int skip;
+
+	while (v) {
+		c = v;
+		v = v->hnext;
+
+		clamma_mutex_lock(&cwc->mut_cwc);
+		z = cwcz_lookup(cwc, c->offset);
+		skip = !!z;
+		if (z) {
+			clamma_dll2_remove(&z->lru);
+			clamma_dll2_add_tail(&z->lru, &cwc->zlru);
+		} else if (cwc->z_alloced + c->len > t->cache_zlimit &&
+			   ++cwc->zinserts % CWC_BIP_EVERY)
+			skip = 1;
+		clamma_mutex_unlock(&cwc->mut_cwc);
+
+		if (!skip) {
+			if (!scratch)
+				scratch = malloc(CWC_BLOCK_SIZE);
+			if (scratch)
+				zl = clamma_wz_compress((uint8_t *)c + sizeof(*c),
+						c->len, scratch, c->len -
+						c->len / CWCZ_MIN_SAVING);
+
+			z = malloc(sizeof(*z) + zl);
+			if (z) {
+				z->offset = c->offset;
+				z->len = c->len;
+				z->zlen = zl;
+				if (zl)
+					memcpy((uint8_t *)z + sizeof(*z),
+					       scratch, zl);
+				clamma_mutex_lock(&cwc->mut_cwc);
+				if (cwcz_lookup(cwc, c->offset))
+					free(z); /* someone beat us to it */
+				else {
+					cwcz_add(t, cwc, z);
+					if (zl)
+						cwc->z_stored++;
+					else
+						cwc->z_rejected++;
+				}
+				clamma_mutex_unlock(&cwc->mut_cwc);
+			}
 		}
+
+		free(c);
+	}
+
+	free(scratch);
+}
+
+static cwc_t *
+cwc_lookup(cwc_state_t *cwc, uint64_t ofs)
+{
+	cwc_t *c;
+
+	for (c = cwc->hash[cwc_hash(ofs)]; c; c = c->hnext)
+		if (c->offset == ofs)
+			return c;
+
+	return NULL;
+}
+
+/*
+ * Blocks are CWC_BLOCK_SIZE, except the last one stops at the end of the file
+ */
+
+static size_t
+cwc_block_len(const txf_t *t, uint64_t ofs)
+{
+	if (ofs + CWC_BLOCK_SIZE > (uint64_t)t->file_size)
+		return (size_t)((uint64_t)t->file_size - ofs);
+
+	return CWC_BLOCK_SIZE;
+}
+
+/*
+ * Create a pinned entry for a miss, listed as filling so it can be read in
+ * without the lock held.  Demand misses use bimodal insertion, prefetches go
+ * in as most recently used since they are about to be needed.
+ */
+
+static cwc_t *
+cwc_insert(const txf_t *t, cwc_state_t *cwc, uint64_t ofs, size_t size,
+	   int prefetch)
+{
+	unsigned int h = cwc_hash(ofs);
+	int full;
+	cwc_t *c;
+
+	full = t->cache_limit && cwc->cwc_alloced + size > t->cache_limit;
+	if (full)
+		cwc_evict(t, cwc, size);
+
 	c = malloc(sizeof(*c) + size);
 	if (!c) {
 		fprintf(stderr, "%s: allocate %llu size failed\n",
 				__func__, (unsigned long long)size);
-		goto bail;
+		return NULL;
 	}
 
+	memset(&c->lru, 0, sizeof(c->lru));
 	c->offset = ofs;
 	c->len = size;
 	c->count = 1;
-	c->next = cwc.cwc_head;
+	c->pins = 1;
+	c->filling = 1;
+	c->failed = 0;
+	c->hnext = cwc->hash[h];
+	cwc->hash[h] = c;
 
-	cwc.cwc_head = c;
-	cwc.cwc_created++;
-	cwc.cwc_alloced += size;
-	cwc.cwc_fetched += size;
+	if (!prefetch && full && ++cwc->inserts % CWC_BIP_EVERY)
+		clamma_dll2_add_head(&c->lru, &cwc->lru);
+	else
+		clamma_dll2_add_tail(&c->lru, &cwc->lru);
 
-	lseek(t->fd, ofs, SEEK_SET);
-	ar = read(t->fd, (uint8_t *)c + sizeof(*c), size);
-	if (ar != (ssize_t)size) {
+	cwc->cwc_created++;
+	cwc->cwc_alloced += size;
+
+	return c;
+}
+
+/*
+ * The read into a filling entry finished with ar bytes, let anyone waiting on
+ * it go.  Returns nonzero if the entry failed, it's unpinned then.
+ */
+
+static int
+cwc_filled(cwc_state_t *cwc, cwc_t *c, ssize_t ar)
+{
+	c->filling = 0;
+	if (ar != (ssize_t)c->len) {
 		fprintf(stderr, "asked to read %d, read %d\n",
-				(int)size, (int)ar);
-		goto bail;
+				(int)c->len, (int)ar);
+		/* don't leave it to be found with garbage in it */
+		c->failed = 1;
+		cwc_unlink(cwc, c);
+	}
+#if defined(LIBCLAMMA_SMP)
+	clamma_cond_broadcast(&cwc->cond_fill);
+#endif
+	if (!c->failed)
+		return 0;
+
+	cwc_unpin(c);
+
+	return 1;
+}
+
+/*
+ * Get the block at file offset ofs pinned, and return its data.  On a miss,
+ * the new entry is listed as filling and pinned before we drop the lock to
+ * read or decompress into it, so lookups of other blocks aren't held up by
+ * the I/O.  Lookups of the same block meanwhile pin it and wait for the fill.
+ * With OpenMP, the team's threads come through here for different rows at
+ * once in the same way.
+ */
+
+static const uint8_t *
+cwc_block(const txf_t *t, uint64_t ofs)
+{
+	/* the cache is the one mutable part of an otherwise const txf */
+	cwc_state_t *cwc = (cwc_state_t *)&t->cwc;
+	const uint8_t *ret = NULL;
+	cwc_t *c, *victims = NULL;
+	cwcz_t *z;
+	uint64_t start;
+	size_t size;
+	ssize_t ar;
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+
+	c = cwc_lookup(cwc, ofs);
+	if (c) {
+		c->count++;
+		c->pins++;
+		cwc->hits++;
+		/* we're the most recently used now */
+		clamma_dll2_remove(&c->lru);
+		clamma_dll2_add_tail(&c->lru, &cwc->lru);
+#if defined(LIBCLAMMA_SMP) || defined(LIBCLAMMA_WITH_OPENMP)
+		if (c->filling) {
+			start = clamma_timestamp_ns();
+			while (c->filling) {
+#if defined(LIBCLAMMA_SMP)
+				clamma_cond_wait(&cwc->cond_fill,
+						 &cwc->mut_cwc);
+#else
+				/* no condition variables with OpenMP */
+				clamma_mutex_unlock(&cwc->mut_cwc);
+				sched_yield();
+				clamma_mutex_lock(&cwc->mut_cwc);
+#endif
+			}
+			cwc->stall_ns += clamma_timestamp_ns() - start;
+		}
+#endif
+		if (c->failed) {
+			cwc_unpin(c);
+			goto bail;
+		}
+		goto hit;
 	}
 
+	cwc->misses++;
+
+	size = cwc_block_len(t, ofs);
+	c = cwc_insert(t, cwc, ofs, size, 0);
+	victims = cwc->victims;
+	cwc->victims = NULL;
+	if (!c)
+		goto bail;
+
+	z = cwcz_pin(cwc, ofs);
+
+	clamma_mutex_unlock(&cwc->mut_cwc);
+
+	clamma_numa_bind(t, (uint8_t *)c + sizeof(*c), size);
+	start = clamma_timestamp_ns();
+	if (z)
+		ar = clamma_wz_decompress((uint8_t *)z + sizeof(*z), z->zlen,
+					  (uint8_t *)c + sizeof(*c), size) ?
+							-1 : (ssize_t)size;
+#if defined(LIBCLAMMA_SMP)
+	else if (cwc->io)
+		ar = clamma_io_pread(cwc->io, (uint8_t *)c + sizeof(*c),
+				     size, ofs);
+#endif
+	else
+		ar = pread(t->fd, (uint8_t *)c + sizeof(*c), size,
+			   (off_t)ofs);
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+
+	cwc->stall_ns += clamma_timestamp_ns() - start;
+	if (z) {
+		z->pins--;
+		cwc->z_hits++;
+	} else
+		cwc->cwc_fetched += size;
+
+	if (cwc_filled(cwc, c, ar))
+		goto bail;
+
 hit:
-	cwc.cwc_touched += size;
 	ret = (uint8_t *)c + sizeof(*c);
 
 bail:
-#if defined(LIBCLAMMA_SMP)
-	clamma_mutex_unlock(&cwc.mut_cwc);
-#endif
+	clamma_mutex_unlock(&cwc->mut_cwc);
+
+	/* our reader is waiting for the data, but not for this */
+	if (victims)
+		cwcz_store(t, victims);
 
 	return ret;
 }
 
+
+/*
+ * Unpin a block we got from cwc_block(), p is what it returned
+ */
+
+static void
+cwc_release(const txf_t *t, const uint8_t *p, size_t touched)
+{
+	cwc_state_t *cwc = (cwc_state_t *)&t->cwc;
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+	cwc->cwc_touched += touched;
+	cwc_unpin((cwc_t *)(p - sizeof(cwc_t)));
+	clamma_mutex_unlock(&cwc->mut_cwc);
+}
+
+/*
+ * Return a pointer to the model data at weight, and in *avail how many of the
+ * len bytes from there are contiguous in memory... that's all of them unless
+ * we're using the malloc cache and they go past the end of a block.  The
+ * block is kept pinned until the next span on the same cursor, or
+ * clamma_weight_span_done().
+ */
+
+const void *
+clamma_weight_span(cwc_cursor_t *cur, const void *weight, size_t len,
+		   size_t *avail)
+{
+	const txf_t *t = cur->t;
+	uint64_t ofs, bofs;
+	size_t in, blen;
+
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE) {
+		*avail = len;
+		return weight;
+	}
+
+	ofs = (uint64_t)((const uint8_t *)weight - (const uint8_t *)t->data);
+	bofs = ofs & ~((uint64_t)CWC_BLOCK_SIZE - 1);
+	if (bofs >= (uint64_t)t->file_size)
+		return NULL;
+
+	if (!cur->pin || cur->ofs != bofs) {
+		clamma_weight_span_done(cur);
+		cur->pin = cwc_block(t, bofs);
+		if (!cur->pin)
+			return NULL;
+		cur->ofs = bofs;
+	}
+
+	in = (size_t)(ofs - bofs);
+	blen = cwc_block_len(t, bofs);
+	*avail = len < blen - in ? len : blen - in;
+
+	cur->touched += *avail;
+
+	return cur->pin + in;
+}
+
+void
+clamma_weight_span_done(cwc_cursor_t *cur)
+{
+	if (!cur->pin)
+		return;
+
+	cwc_release(cur->t, cur->pin, cur->touched);
+	cur->pin = NULL;
+	cur->touched = 0;
+}
+
+/*
+ * Copy len bytes of the model from weight into dst, wherever they are
+ */
+
+int
+clamma_weight_read(const txf_t *t, void *dst, const void *weight, size_t len)
+{
+	cwc_cursor_t cur = { t, NULL, 0, 0 };
+	const uint8_t *w = weight;
+	uint8_t *d = dst;
+	const void *p;
+	size_t avail;
+
+	while (len) {
+		p = clamma_weight_span(&cur, w, len, &avail);
+		if (!p) {
+			clamma_weight_span_done(&cur);
+			return 1;
+		}
+		memcpy(d, p, avail);
+		d += avail;
+		w += avail;
+		len -= avail;
+	}
+
+	clamma_weight_span_done(&cur);
+
+	return 0;
+}
+
+#if defined(LIBCLAMMA_SMP)
+
+/*
+ * clamma_session_forward() goes through the weights in the same order every
+ * token, one layer at a time and then the final norm and classifier.  We call
+ * each of these a unit, with the final norm and classifier being unit
+ * n_layers.  This lists the ranges of the model the forward reads for a unit.
+ */
+
+typedef struct {
+	const void	*p;
+	size_t		len;
+} cwc_ref_t;
+
+#define CWC_UNIT_REFS	16
+
+static unsigned int
+cwc_qt_refs(const txf_t *t, cwc_ref_t *r, const qt_t *w, size_t n, size_t d)
+{
+	r[0].p = w->q;
+	r[0].len = d * n;
+	r[1].p = w->s;
+	r[1].len = ((d * n) / t->c.group_size) * sizeof(float);
+
+	return 2;
+}
+
+static unsigned int
+cwc_unit_refs(const txf_t *t, unsigned int u, cwc_ref_t *r)
+{
+	size_t dim = t->c.dim, hd = t->c.hidden_dim,
+	       kv_dim = (dim * t->c.n_kv_heads) / t->c.n_heads;
+	unsigned int n = 0;
+
+	if (u == t->c.n_layers) {
+		r[n].p = t->w.rms_final_weight;
+		r[n++].len = dim * sizeof(float);
+		if (t->c.version == CLAMMA_MODEL_VERSION2_INT8_80)
+			return n + cwc_qt_refs(t, &r[n], t->w.wcls,
+					       dim, t->c.vocab_size);
+
+		r[n].p = t->w.wcls;
+		r[n++].len = dim * t->c.vocab_size * sizeof(float);
+
+		return n;
+	}
+
+	r[n].p = t->w.rms_att_weight + u * dim;
+	r[n++].len = dim * sizeof(float);
+
+	if (t->c.version == CLAMMA_MODEL_VERSION2_INT8_80) {
+		n += cwc_qt_refs(t, &r[n], t->w.wq + u, dim, dim);
+		n += cwc_qt_refs(t, &r[n], t->w.wk + u, dim, kv_dim);
+		n += cwc_qt_refs(t, &r[n], t->w.wv + u, dim, kv_dim);
+		n += cwc_qt_refs(t, &r[n], t->w.wo + u, dim, dim);
+		r[n].p = t->w.rms_ffn_weight + u * dim;
+		r[n++].len = dim * sizeof(float);
+		n += cwc_qt_refs(t, &r[n], t->w.w1 + u, dim, hd);
+		n += cwc_qt_refs(t, &r[n], t->w.w3 + u, dim, hd);
+		n += cwc_qt_refs(t, &r[n], t->w.w2 + u, hd, dim);
+
+		return n;
+	}
+
+	r[n].p = (txi_t *)t->w.wq + u * dim * dim;
+	r[n++].len = dim * dim * sizeof(float);
+	r[n].p = (txi_t *)t->w.wk + u * dim * kv_dim;
+	r[n++].len = dim * kv_dim * sizeof(float);
+	r[n].p = (txi_t *)t->w.wv + u * dim * kv_dim;
+	r[n++].len = dim * kv_dim * sizeof(float);
+	r[n].p = (txi_t *)t->w.wo + u * dim * dim;
+	r[n++].len = dim * dim * sizeof(float);
+	r[n].p = t->w.rms_ffn_weight + u * dim;
+	r[n++].len = dim * sizeof(float);
+	r[n].p = (txi_t *)t->w.w1 + u * dim * hd;
+	r[n++].len = dim * hd * sizeof(float);
+	r[n].p = (txi_t *)t->w.w3 + u * dim * hd;
+	r[n++].len = dim * hd * sizeof(float);
+	r[n].p = (txi_t *)t->w.w2 + u * dim * hd;
+	r[n++].len = dim * hd * sizeof(float);
+
+	return n;
+}
+
+static size_t
+cwc_unit_size(const cwc_ref_t *r, unsigned int n)
+{
+	size_t size = 0;
+
+	while (n--)
+		size += r[n].len;
+
+	return size;
+}
+
+/*
+ * Create entries for whatever blocks of the unit aren't cached, and fill them
+ * in batches, so the reads are outstanding together.  Blocks in the compressed
+ * tier are decompressed instead.
+ */
+
+#define CWC_PREFETCH_BATCH	32
+
+static void
+cwc_prefetch_unit(txf_t *t, const cwc_ref_t *r, unsigned int n)
+{
+	cwc_t *c, *cs[CWC_PREFETCH_BATCH], *cd[CWC_PREFETCH_BATCH], *victims;
+	unsigned int m = 0, k, count, dcount;
+	clamma_io_req_t req[CWC_PREFETCH_BATCH];
+	cwcz_t *z, *zs[CWC_PREFETCH_BATCH];
+	cwc_state_t *cwc = &t->cwc;
+	ssize_t dres[CWC_PREFETCH_BATCH];
+	uint64_t ofs, end;
+
+	ofs = (uint64_t)((uint8_t *)r[0].p - ((uint8_t *)t->data)) &
+						~((uint64_t)CWC_BLOCK_SIZE - 1);
+
+	while (m < n) {
+		count = 0;
+		dcount = 0;
+		clamma_mutex_lock(&cwc->mut_cwc);
+
+		if (cwc->prefetch_unit >= 0 || cwc->prefetch_exit) {
+			/* the forward already moved on, abandon the rest */
+			clamma_mutex_unlock(&cwc->mut_cwc);
+			break;
+		}
+
+		while (m < n && count + dcount < CWC_PREFETCH_BATCH) {
+			end = (uint64_t)((uint8_t *)r[m].p -
+					 ((uint8_t *)t->data)) + r[m].len;
+			if (ofs >= end) {
+				/* on to the next range's first block */
+				if (++m < n)
+					ofs = (uint64_t)((uint8_t *)r[m].p -
+						((uint8_t *)t->data)) &
+						~((uint64_t)CWC_BLOCK_SIZE - 1);
+				continue;
+			}
+
+			c = cwc_lookup(cwc, ofs);
+			if (c) {
+				/* keep it from being evicted before use */
+				clamma_dll2_remove(&c->lru);
+				clamma_dll2_add_tail(&c->lru, &cwc->lru);
+				ofs += CWC_BLOCK_SIZE;
+				continue;
+			}
+
+			c = cwc_insert(t, cwc, ofs, cwc_block_len(t, ofs), 1);
+			if (!c) {
+				m = n;
+				break;
+			}
+			cwc->prefetched++;
+
+			z = cwcz_pin(cwc, ofs);
+			if (z) {
+				zs[dcount] = z;
+				cd[dcount++] = c;
+			} else {
+				cs[count] = c;
+				req[count].buf = (uint8_t *)c + sizeof(*c);
+				req[count].len = c->len;
+				req[count++].ofs = ofs;
+				cwc->cwc_fetched += c->len;
+			}
+			ofs += CWC_BLOCK_SIZE;
+		}
+
+		victims = cwc->victims;
+		cwc->victims = NULL;
+		clamma_mutex_unlock(&cwc->mut_cwc);
+
+		for (k = 0; k < count; k++)
+			clamma_numa_bind(t, req[k].buf, req[k].len);
+
+		/*
+		 * If the batched read fails, the io has already finished with
+		 * the buffers, so we can just read them ourselves
+		 */
+
+		if (!cwc->io || clamma_io_read(cwc->io, req, count))
+			for (k = 0; k < count; k++)
+				req[k].res = pread(t->fd, req[k].buf,
+						   req[k].len,
+						   (off_t)req[k].ofs);
+
+		for (k = 0; k < dcount; k++) {
+			clamma_numa_bind(t, (uint8_t *)cd[k] + sizeof(cwc_t),
+					 cd[k]->len);
+			dres[k] = clamma_wz_decompress((uint8_t *)zs[k] +
+					sizeof(cwcz_t), zs[k]->zlen,
+					(uint8_t *)cd[k] + sizeof(cwc_t),
+					cd[k]->len) ? -1 : (ssize_t)cd[k]->len;
+		}
+
+		clamma_mutex_lock(&cwc->mut_cwc);
+		for (k = 0; k < count; k++)
+			if (!cwc_filled(cwc, cs[k], req[k].res))
+				cwc_unpin(cs[k]);
+		for (k = 0; k < dcount; k++) {
+			zs[k]->pins--;
+			cwc->z_hits++;
+			if (!cwc_filled(cwc, cd[k], dres[k]))
+				cwc_unpin(cd[k]);
+		}
+		clamma_mutex_unlock(&cwc->mut_cwc);
+
+		if (victims)
+			cwcz_store(t, victims);
+	}
+}
+
+/*
+ * The prefetch thread loads the unit after the one being computed, so its
+ * I/O overlaps with the compute.  Requests are one deep, if the forward asks
+ * for another unit before we got to the last one, only the newer is loaded,
+ * and if it asks while we're still loading, the rest of the old unit is
+ * abandoned after the batch in flight.
+ *
+ * Loading a unit can evict the one being computed if the cache can't hold
+ * both, which just moves the stall... we skip units that won't fit alongside
+ * the unit before them.
+ */
+
+static void *
+cwc_prefetch_thread(void *d)
+{
+	txf_t *t = (txf_t *)d;
+	cwc_state_t *cwc = &t->cwc;
+	cwc_ref_t r[CWC_UNIT_REFS], rp[CWC_UNIT_REFS];
+	unsigned int n, np, u;
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+
+	while (!cwc->prefetch_exit) {
+		if (cwc->prefetch_unit < 0) {
+			clamma_cond_wait(&cwc->cond_prefetch, &cwc->mut_cwc);
+			continue;
+		}
+
+		u = (unsigned int)cwc->prefetch_unit;
+		cwc->prefetch_unit = -1;
+		clamma_mutex_unlock(&cwc->mut_cwc);
+
+		n = cwc_unit_refs(t, u, r);
+		np = cwc_unit_refs(t, u ? u - 1 : t->c.n_layers, rp);
+
+		if (!t->cache_limit || cwc_unit_size(r, n) +
+				cwc_unit_size(rp, np) <= t->cache_limit)
+			cwc_prefetch_unit(t, r, n);
+
+		clamma_mutex_lock(&cwc->mut_cwc);
+	}
+
+	clamma_mutex_unlock(&cwc->mut_cwc);
+
+	return NULL;
+}
+
+#endif
+
+/*
+ * Ask for unit to be loaded in the background, if there's a prefetch thread
+ */
+
 void
-clamma_weight_cache_init(void)
+clamma_weight_prefetch(const txf_t *t, unsigned int unit)
 {
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_init(&cwc.mut_cwc);
+	cwc_state_t *cwc = (cwc_state_t *)&t->cwc;
+
+	if (!cwc->prefetch_running)
+		return;
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+	cwc->prefetch_unit = (int)(unit % (t->c.n_layers + 1));
+	clamma_cond_broadcast(&cwc->cond_prefetch);
+	clamma_mutex_unlock(&cwc->mut_cwc);
+#else
+	(void)t;
+	(void)unit;
 #endif
 }
 
+/*
+ * It's only worth having a prefetch thread if it's our own code fetching the
+ * weights... it's not fatal if we can't have one
+ */
+
 void
-clamma_weight_cache_deinit(void)
+clamma_weight_prefetch_start(txf_t *t)
 {
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_destroy(&cwc.mut_cwc);
+	cwc_state_t *cwc = &t->cwc;
+
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE ||
+	    cwc->prefetch_running)
+		return;
+
+	/* without it, we just pread() each entry */
+	cwc->io = clamma_io_create(t->fd, t->fd_direct);
+
+	cwc->prefetch_unit = -1;
+	cwc->prefetch_exit = 0;
+	if (pthread_create(&cwc->pt_prefetch, NULL, cwc_prefetch_thread, t)) {
+		fprintf(stderr, "%s: unable to start prefetch thread\n",
+				__func__);
+		if (cwc->io) {
+			clamma_io_destroy(cwc->io);
+			cwc->io = NULL;
+		}
+		return;
+	}
+
+	cwc->prefetch_running = 1;
+#else
+	(void)t;
 #endif
 }
 
 void
-clamma_weight_cache_clear(void)
+clamma_weight_prefetch_stop(txf_t *t)
 {
-	cwc_t *c = cwc.cwc_head, *c1;
+#if defined(LIBCLAMMA_SMP)
+	cwc_state_t *cwc = &t->cwc;
 
-	fprintf(stderr, "    cwc: created: %d, fetched: %lluM, touched: %lluM\n",
-			cwc.cwc_created,
-			(unsigned long long)cwc.cwc_fetched / (1024 * 1024),
-			(unsigned long long)cwc.cwc_touched / (1024 * 1024));
+	if (!cwc->prefetch_running)
+		return;
 
-	while (c) {
-		c1 = c;
-		c = c->next;
-		free(c1);
+	clamma_mutex_lock(&cwc->mut_cwc);
+	cwc->prefetch_exit = 1;
+	clamma_cond_broadcast(&cwc->cond_prefetch);
+	clamma_mutex_unlock(&cwc->mut_cwc);
+
+	pthread_join(cwc->pt_prefetch, NULL);
+	cwc->prefetch_running = 0;
+
+	if (cwc->io) {
+		clamma_io_destroy(cwc->io);
+		cwc->io = NULL;
 	}
+#else
+	(void)t;
+#endif
+}
+
+void
+clamma_weight_cache_init(txf_t *t)
+{
+	memset(&t->cwc, 0, sizeof(t->cwc));
+	clamma_mutex_init(&t->cwc.mut_cwc);
+#if defined(LIBCLAMMA_SMP)
+	clamma_cond_init(&t->cwc.cond_fill);
+	clamma_cond_init(&t->cwc.cond_prefetch);
+	t->cwc.prefetch_unit = -1;
+#endif
+}
+
+/*
+ * Snapshot the cache counters under the lock, so they're consistent with
+ * each other, plus the process major faults.  Apps may poll this from any
+ * thread while the transformer is in use.
+ */
+
+int
+clamma_txf_stats(const txf_t *t, clamma_txf_stats_t *st)
+{
+	cwc_state_t *cwc = (cwc_state_t *)&t->cwc;
+#if !defined(_WIN32)
+	struct rusage ru;
+#endif
+
+	memset(st, 0, sizeof(*st));
+
+	clamma_mutex_lock(&cwc->mut_cwc);
+	st->blocks_created	= (uint64_t)cwc->cwc_created;
+	st->bytes_read		= cwc->cwc_fetched;
+	st->bytes_touched	= cwc->cwc_touched;
+	st->resident		= cwc->cwc_alloced;
+	st->hits		= cwc->hits;
+	st->misses		= cwc->misses;
+	st->prefetched		= cwc->prefetched;
+	st->evictions		= cwc->evictions;
+	st->stall_us		= cwc->stall_ns / 1000;
+	st->compressed_hits	= cwc->z_hits;
+	st->compressed_stored	= cwc->z_stored;
+	st->compressed_resident	= cwc->z_alloced;
+	clamma_mutex_unlock(&cwc->mut_cwc);
+
+	if (st->hits + st->misses)
+		st->hit_ratio = (float)((double)st->hits /
+					(double)(st->hits + st->misses));
+
+#if !defined(_WIN32)
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 1;
+
+	st->major_faults = (uint64_t)ru.ru_majflt;
+#endif
+
+	return 0;
+}
+
+/*
+ * Report on and free everything in the transformer's cache
+ */
+
+void
+clamma_weight_cache_deinit(txf_t *t)
+{
+	cwc_state_t *cwc = &t->cwc;
+	clamma_dll2_t *d;
+
+	clamma_weight_prefetch_stop(t);
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE)
+		fprintf(stderr, "    cwc: created: %d, fetched: %lluM, "
+				"touched: %lluM, hits: %llu, misses: %llu, "
+				"prefetched: %llu, evictions: %llu\n",
+			cwc->cwc_created,
+			(unsigned long long)cwc->cwc_fetched / (1024 * 1024),
+			(unsigned long long)cwc->cwc_touched / (1024 * 1024),
+			(unsigned long long)cwc->hits,
+			(unsigned long long)cwc->misses,
+			(unsigned long long)cwc->prefetched,
+			(unsigned long long)cwc->evictions);
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE &&
+	    t->cache_zlimit)
+		fprintf(stderr, "    cwcz: stored: %llu, rejected: %llu, "
+				"hits: %llu, resident: %lluK\n",
+			(unsigned long long)cwc->z_stored,
+			(unsigned long long)cwc->z_rejected,
+			(unsigned long long)cwc->z_hits,
+			(unsigned long long)cwc->z_alloced / 1024);
+
+	while ((d = cwc->lru.head))
+		cwc_destroy(cwc, clamma_container_of(d, cwc_t, lru));
+
+	while ((d = cwc->zlru.head))
+		cwcz_destroy(cwc, clamma_container_of(d, cwcz_t, lru));
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_cond_destroy(&cwc->cond_prefetch);
+	clamma_cond_destroy(&cwc->cond_fill);
+#endif
+	clamma_mutex_destroy(&cwc->mut_cwc);
 }
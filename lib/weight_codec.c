@@ -0,0 +1,600 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Byte-level codec for blocks of the compressed weight cache tier.
+ *
+ * Weights don't have the repeats that LZ-style compressors look for, what
+ * they do have is a skewed distribution of byte values.  int8 weights cluster
+ * around zero, and in floats (f32 weights and the int8 scales) the byte with
+ * the sign and most of the exponent takes only a few values.  So each block
+ * is entropy coded with its own length-limited Huffman code, either as plain
+ * bytes, or with the bytes split into four planes by their position in a
+ * float, each plane having its own code... whichever comes out smaller.
+ *
+ * The mantissa planes of floats hardly compress, and Huffman decoding is the
+ * slow part, so planes that wouldn't shrink by at least WZ_RAW_FRACTION are
+ * stored raw.  Then decompressing float blocks is mostly strided copies.
+ *
+ * The format is a mode byte, then for each of the one or four streams, its
+ * code lengths packed in 128 bytes of nibbles, its coded length as 4 bytes
+ * little-endian, and the coded data.  Raw streams have all their code lengths
+ * zero.
+ */
+
+#include "private.h"
+
+#define WZ_MAX_BITS		12
+#define WZ_TABLE		(1 << WZ_MAX_BITS)
+#define WZ_STREAM_HDR		(128 + 4)
+#define WZ_RAW_FRACTION		8 /* code a stream if it saves 1/8 */
+#define WZ_LANES		4
+
+enum {
+	WZ_MODE_BYTES,
+	WZ_MODE_PLANES,
+};
+
+typedef struct {
+	uint32_t	f;
+	uint16_t	s;
+} wz_leaf_t;
+
+static int
+wz_leaf_cmp(const void *a, const void *b)
+{
+	const wz_leaf_t *la = a, *lb = b;
+
+	if (la->f != lb->f)
+		return la->f < lb->f ? -1 : 1;
+
+	return (int)la->s - (int)lb->s;
+}
+
+/*
+ * Compute Huffman code lengths for the byte frequencies, no longer than
+ * WZ_MAX_BITS so one table lookup decodes any symbol.  If the tree is too
+ * deep, the frequencies are flattened and we try again.
+ */
+
+static void
+wz_lengths(const uint32_t *freq_in, uint8_t *lens)
+{
+	unsigned int n, i, a, b, q1, q2, nodes, max;
+	uint32_t freq[256], w[511];
+	uint16_t parent[511];
+	uint8_t depth[511];
+	wz_leaf_t leaf[256];
+
+	memcpy(freq, freq_in, sizeof(freq));
+
+	for (;;) {
+		memset(lens, 0, 256);
+
+		n = 0;
+		for (i = 0; i < 256; i++)
+			if (freq[i]) {
+				leaf[n].f = freq[i];
+				leaf[n++].s = (uint16_t)i;
+			}
+
+		if (n < 2) {
+			if (n)
+				lens[leaf[0].s] = 1;
+			return;
+		}
+
+		qsort(leaf, n, sizeof(leaf[0]), wz_leaf_cmp);
+		for (i = 0; i < n; i++)
+			w[i] = leaf[i].f;
+
+		/*
+		 * Leaves are sorted, and internal nodes are created in
+		 * increasing weight order, so taking the lighter head of the
+		 * two queues each time builds the tree without a heap
+		 */
+
+		q1 = 0;
+		q2 = n;
+		for (nodes = n; nodes < 2 * n - 1; nodes++) {
+			a = (q1 < n && (q2 == nodes || w[q1] <= w[q2])) ?
+								q1++ : q2++;
+			b = (q1 < n && (q2 == nodes || w[q1] <= w[q2])) ?
+								q1++ : q2++;
+			w[nodes] = w[a] + w[b];
+			parent[a] = (uint16_t)nodes;
+			parent[b] = (uint16_t)nodes;
+		}
+
+		/* parents always come after their children */
+
+		depth[nodes - 1] = 0;
+		for (i = nodes - 1; i-- > 0; )
+			depth[i] = (uint8_t)(depth[parent[i]] + 1);
+
+		max = 0;
+		for (i = 0; i < n; i++) {
+			lens[leaf[i].s] = depth[i];
+			if (depth[i] > max)
+				max = depth[i];
+		}
+
+		if (max <= WZ_MAX_BITS)
+			return;
+
+		for (i = 0; i < 256; i++)
+			if (freq[i])
+				freq[i] = (freq[i] >> 1) | 1;
+	}
+}
+
+/*
+ * Canonical codes from the lengths, bit-reversed since the stream is LSB-first
+ */
+
+static void
+wz_codes(const uint8_t *lens, uint16_t *codes)
+{
+	unsigned int count[WZ_MAX_BITS + 1], next[WZ_MAX_BITS + 1], code = 0,
+		     b, s, c, r;
+
+	memset(count, 0, sizeof(count));
+	for (s = 0; s < 256; s++)
+		count[lens[s]]++;
+	count[0] = 0;
+
+	for (b = 1; b <= WZ_MAX_BITS; b++) {
+		code = (code + count[b - 1]) << 1;
+		next[b] = code;
+	}
+
+	for (s = 0; s < 256; s++) {
+		if (!lens[s])
+			continue;
+		c = next[lens[s]]++;
+		r = 0;
+		for (b = 0; b < lens[s]; b++)
+			r |= ((c >> b) & 1) << (lens[s] - 1 - b);
+		codes[s] = (uint16_t)r;
+	}
+}
+
+/*
+ * Count the byte values in each of the four float byte planes, for len & ~3
+ * bytes... the plain byte counts are the sum of the planes' plus the tail
+ */
+
+static void
+wz_histograms(const uint8_t *in, size_t len, uint32_t freq[5][256])
+{
+	size_t i;
+
+	memset(freq, 0, 5 * 256 * sizeof(freq[0][0]));
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		freq[0][in[i]]++;
+		freq[1][in[i + 1]]++;
+		freq[2][in[i + 2]]++;
+		freq[3][in[i + 3]]++;
+	}
+
+	for (; i < len; i++)
+		freq[4][in[i]]++;
+
+	for (i = 0; i < 256; i++)
+		freq[4][i] += freq[0][i] + freq[1][i] + freq[2][i] +
+			      freq[3][i];
+}
+
+static inline uint64_t
+wz_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+
+	return v;
+}
+
+/*
+ * The bits a stream of n bytes takes coded with lens, or if that doesn't save
+ * enough, the bits it takes raw, with lens set to all zero to say so
+ */
+
+static size_t
+wz_bits(const uint32_t *freq, uint8_t *lens, size_t n)
+{
+	size_t bits = 0;
+	unsigned int s;
+
+	for (s = 0; s < 256; s++)
+		bits += (size_t)freq[s] * lens[s];
+
+	if (bits > n * 8 - (n * 8) / WZ_RAW_FRACTION) {
+		memset(lens, 0, 256);
+		bits = n * 8;
+	}
+
+	return bits + 8 * WZ_STREAM_HDR;
+}
+
+static int
+wz_is_raw(const uint8_t *lens)
+{
+	unsigned int s;
+
+	for (s = 0; s < 256; s++)
+		if (lens[s])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Huffman code n bytes, stride apart, from in to p.  Returns the bytes used,
+ * or 0 if it won't fit before end.
+ */
+
+static size_t
+wz_huff_encode_lane(const uint8_t *in, size_t n, size_t stride,
+		    const uint8_t *lens, const uint16_t *codes, uint8_t *p,
+		    const uint8_t *end)
+{
+	uint8_t *start = p;
+	unsigned int bits = 0;
+	uint64_t buf = 0;
+
+	while (n--) {
+		buf |= (uint64_t)codes[*in] << bits;
+		bits += lens[*in];
+		in += stride;
+
+		if (bits >= 32) {
+			if (end - p < 4)
+				return 0;
+			p[0] = (uint8_t)buf;
+			p[1] = (uint8_t)(buf >> 8);
+			p[2] = (uint8_t)(buf >> 16);
+			p[3] = (uint8_t)(buf >> 24);
+			p += 4;
+			buf >>= 32;
+			bits -= 32;
+		}
+	}
+
+	while (bits) {
+		if (p == end)
+			return 0;
+		*p++ = (uint8_t)buf;
+		buf >>= 8;
+		bits = bits > 8 ? bits - 8 : 0;
+	}
+
+	return (size_t)(p - start);
+}
+
+/*
+ * Decoding a symbol needs the previous one's length, so one bitstream is a
+ * long dependency chain.  Symbol i goes in lane i % WZ_LANES instead, each
+ * lane being its own bitstream, and the lanes are decoded in lockstep.  The
+ * coded data starts with each lane's length as 4 bytes little-endian.
+ */
+
+static size_t
+wz_huff_encode(const uint8_t *in, size_t n, size_t stride,
+	       const uint8_t *lens, uint8_t *p, const uint8_t *end)
+{
+	size_t used = 4 * WZ_LANES, u;
+	uint16_t codes[256];
+	unsigned int j;
+
+	if ((size_t)(end - p) < used)
+		return 0;
+
+	wz_codes(lens, codes);
+
+	for (j = 0; j < WZ_LANES; j++) {
+		u = wz_huff_encode_lane(in + j * stride,
+					n > j ? (n - j + WZ_LANES - 1) / WZ_LANES : 0,
+					stride * WZ_LANES, lens, codes, p + used,
+					end);
+		if (!u && n > j)
+			return 0;
+		p[4 * j] = (uint8_t)u;
+		p[4 * j + 1] = (uint8_t)(u >> 8);
+		p[4 * j + 2] = (uint8_t)(u >> 16);
+		p[4 * j + 3] = (uint8_t)(u >> 24);
+		used += u;
+	}
+
+	return used;
+}
+
+/*
+ * Code n bytes, stride apart, from in into out as one stream, raw if lens is
+ * all zero.  Returns the bytes used at out, or 0 if it won't fit in out_max.
+ */
+
+static size_t
+wz_stream_encode(const uint8_t *in, size_t n, size_t stride,
+		 const uint8_t *lens, uint8_t *out, size_t out_max)
+{
+	uint8_t *p = out + WZ_STREAM_HDR;
+	unsigned int s;
+	size_t zlen, i;
+
+	if (out_max < WZ_STREAM_HDR)
+		return 0;
+
+	for (s = 0; s < 256; s += 2)
+		out[s / 2] = (uint8_t)(lens[s] | (lens[s + 1] << 4));
+
+	if (wz_is_raw(lens)) {
+		if (out_max - WZ_STREAM_HDR < n)
+			return 0;
+		for (i = 0; i < n; i++)
+			p[i] = in[i * stride];
+		zlen = n;
+	} else {
+		zlen = wz_huff_encode(in, n, stride, lens, p, out + out_max);
+		if (!zlen)
+			return 0;
+	}
+
+	out[128] = (uint8_t)zlen;
+	out[129] = (uint8_t)(zlen >> 8);
+	out[130] = (uint8_t)(zlen >> 16);
+	out[131] = (uint8_t)(zlen >> 24);
+
+	return WZ_STREAM_HDR + zlen;
+}
+
+typedef struct {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	uint64_t	buf;
+	unsigned int	bits;
+} wz_lane_t;
+
+/*
+ * Decode the Huffman coded lanes from p to end into n bytes at out, stride
+ * apart.  Returns 0 if OK or 1 if it's corrupt.
+ */
+
+static int
+wz_huff_decode(const uint8_t *lens, const uint8_t *p, const uint8_t *end,
+	       uint8_t *out, size_t n, size_t stride)
+{
+	uint16_t codes[256], table[WZ_TABLE];
+	unsigned int s, l, e, j, fast;
+	wz_lane_t lane[WZ_LANES], *ln;
+	size_t i, u;
+
+	if ((size_t)(end - p) < 4 * WZ_LANES)
+		return 1;
+
+	for (j = 0; j < WZ_LANES; j++) {
+		u = (size_t)p[4 * j] | ((size_t)p[4 * j + 1] << 8) |
+		    ((size_t)p[4 * j + 2] << 16) | ((size_t)p[4 * j + 3] << 24);
+		lane[j].p = j ? lane[j - 1].end : p + 4 * WZ_LANES;
+		if (u > (size_t)(end - lane[j].p))
+			return 1;
+		lane[j].end = lane[j].p + u;
+		lane[j].buf = 0;
+		lane[j].bits = 0;
+	}
+
+	/* every code fills the table entries ending in its bits */
+
+	wz_codes(lens, codes);
+	memset(table, 0, sizeof(table));
+	for (s = 0; s < 256; s++)
+		if (lens[s])
+			for (i = codes[s]; i < WZ_TABLE; i += 1u << lens[s])
+				table[i] = (uint16_t)(s | (lens[s] << 8));
+
+	/*
+	 * While every lane has 8 bytes left to load, refill them to at least
+	 * 56 bits in one go, that's enough for four symbols each
+	 */
+
+	for (i = 0; i + 4 * WZ_LANES <= n; i += 4 * WZ_LANES) {
+		fast = 1;
+		for (j = 0; j < WZ_LANES; j++)
+			fast &= lane[j].end - lane[j].p >= 8;
+		if (!fast)
+			break;
+
+		for (j = 0; j < WZ_LANES; j++) {
+			ln = &lane[j];
+			ln->buf |= wz_le64(ln->p) << ln->bits;
+			ln->p += (63 - ln->bits) >> 3;
+			ln->bits |= 56;
+		}
+
+		for (s = 0; s < 4; s++)
+			for (j = 0; j < WZ_LANES; j++) {
+				ln = &lane[j];
+				e = table[ln->buf & (WZ_TABLE - 1)];
+				l = e >> 8;
+				if (!l)
+					return 1;
+				out[(i + s * WZ_LANES + j) * stride] =
+								(uint8_t)e;
+				ln->buf >>= l;
+				ln->bits -= l;
+			}
+	}
+
+	for (; i < n; i++) {
+		ln = &lane[i % WZ_LANES];
+		while (ln->bits <= 56 && ln->p < ln->end) {
+			ln->buf |= (uint64_t)*ln->p++ << ln->bits;
+			ln->bits += 8;
+		}
+
+		e = table[ln->buf & (WZ_TABLE - 1)];
+		l = e >> 8;
+		if (!l || l > ln->bits)
+			return 1;
+
+		out[i * stride] = (uint8_t)e;
+		ln->buf >>= l;
+		ln->bits -= l;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode one stream of n bytes into out, stride apart.  Returns the bytes of
+ * in used, or 0 if it's corrupt.
+ */
+
+static size_t
+wz_stream_decode(const uint8_t *in, size_t in_len, uint8_t *out, size_t n,
+		 size_t stride)
+{
+	const uint8_t *p = in + WZ_STREAM_HDR;
+	uint8_t lens[256];
+	unsigned int s;
+	size_t zlen, i;
+
+	if (in_len < WZ_STREAM_HDR)
+		return 0;
+
+	for (s = 0; s < 256; s += 2) {
+		lens[s] = in[s / 2] & 0xf;
+		lens[s + 1] = in[s / 2] >> 4;
+		if (lens[s] > WZ_MAX_BITS || lens[s + 1] > WZ_MAX_BITS)
+			return 0;
+	}
+
+	zlen = (size_t)in[128] | ((size_t)in[129] << 8) |
+	       ((size_t)in[130] << 16) | ((size_t)in[131] << 24);
+	if (zlen > in_len - WZ_STREAM_HDR)
+		return 0;
+
+	if (wz_is_raw(lens)) {
+		if (zlen != n)
+			return 0;
+		for (i = 0; i < n; i++)
+			out[i * stride] = p[i];
+	} else
+		if (wz_huff_decode(lens, p, p + zlen, out, n, stride))
+			return 0;
+
+	return WZ_STREAM_HDR + zlen;
+}
+
+/*
+ * Compress len bytes from in to out.  Returns the compressed length, or 0 if
+ * it doesn't come out smaller than out_max.
+ */
+
+size_t
+clamma_wz_compress(const uint8_t *in, size_t len, uint8_t *out,
+		   size_t out_max)
+{
+	uint8_t lens[5][256]; /* the planes, then plain bytes */
+	uint32_t freq[5][256];
+	size_t bits_b, bits_p = 0, used = 1, u;
+	unsigned int k;
+
+	if (out_max < 1)
+		return 0;
+
+	wz_histograms(in, len, freq);
+	wz_lengths(freq[4], lens[4]);
+	bits_b = wz_bits(freq[4], lens[4], len);
+
+	if (!(len & 3)) {
+		for (k = 0; k < 4; k++) {
+			wz_lengths(freq[k], lens[k]);
+			bits_p += wz_bits(freq[k], lens[k], len / 4);
+		}
+
+		if (bits_p < bits_b) {
+			if ((bits_p + 7) / 8 + 1 > out_max)
+				return 0;
+
+			out[0] = WZ_MODE_PLANES;
+			for (k = 0; k < 4; k++) {
+				u = wz_stream_encode(in + k, len / 4, 4,
+						lens[k], out + used,
+						out_max - used);
+				if (!u)
+					return 0;
+				used += u;
+			}
+
+			return used;
+		}
+	}
+
+	if ((bits_b + 7) / 8 + 1 > out_max)
+		return 0;
+
+	out[0] = WZ_MODE_BYTES;
+	u = wz_stream_encode(in, len, 1, lens[4], out + 1, out_max - 1);
+
+	return u ? u + 1 : 0;
+}
+
+/*
+ * Decompress zlen bytes from in, which must produce exactly len bytes at out.
+ * Returns 0 if OK, or 1 if it's corrupt.
+ */
+
+int
+clamma_wz_decompress(const uint8_t *in, size_t zlen, uint8_t *out, size_t len)
+{
+	size_t used = 1, u;
+	unsigned int k;
+
+	if (zlen < 1)
+		return 1;
+
+	switch (in[0]) {
+	case WZ_MODE_BYTES:
+		return !wz_stream_decode(in + 1, zlen - 1, out, len, 1);
+
+	case WZ_MODE_PLANES:
+		if (len & 3)
+			return 1;
+		for (k = 0; k < 4; k++) {
+			u = wz_stream_decode(in + used, zlen - used, out + k,
+					     len / 4, 4);
+			if (!u)
+				return 1;
+			used += u;
+		}
+		return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,276 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-admission checks how queries are admitted
+ * against a transformer's mem_budget: rejected, shrunk to fit, or queued
+ * until another query releases enough, including beside a session pool.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "test-model.h"
+
+struct test_gather {
+	unsigned int count;
+};
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_gather *g = (struct test_gather *)opaque_user_pointer;
+
+	if (piece[0] != TOK_EOS)
+		g->count++;
+
+	return 0;
+}
+
+static int
+query(struct txf_session *ts, clamma_txf_info_t *info, size_t limit,
+      clamma_admission_t admission, struct test_gather *g)
+{
+	info->limit = limit;
+	info->admission = admission;
+	info->opaque_user_pointer = g;
+
+	return clamma_session_query(ts, info);
+}
+
+/* step the session until its query ends, returns how many steps it took */
+
+static int
+run(struct txf_session *ts)
+{
+	int n = 0, r;
+
+	while ((r = clamma_session_step(ts)) == 1)
+		n++;
+
+	return r < 0 ? -1 : n + 1;
+}
+
+/*
+ * The session pool's reservation is held for the life of the transformer, so
+ * QUEUE must reject what could only fit if the pool gave its memory back
+ */
+
+static int
+pool_case(clamma_txf_info_t *info, size_t fixed, size_t pp)
+{
+	struct txf_session *p = NULL, *a = NULL;
+	size_t budget = info->mem_budget;
+	struct test_gather g;
+	struct txf *t;
+	int ret = 1;
+
+	info->session_pool = 1;
+	info->mem_budget = (2 * fixed) + ((TEST_MODEL_SEQ_LEN + 50) * pp);
+	t = clamma_txf_construct(info);
+	info->session_pool = 0;
+	info->mem_budget = budget;
+	if (!t)
+		return 1;
+
+	p = clamma_session_construct(t);
+	a = clamma_session_construct(t);
+	if (!p || !a) {
+		fprintf(stderr, "unable to construct pool sessions\n");
+		goto bail;
+	}
+
+	memset(&g, 0, sizeof(g));
+	if (!query(a, info, 60, CLAMMA_ADMIT_QUEUE, &g) ||
+	    clamma_session_step(a) != -1) {
+		fprintf(stderr, "queued beyond the pool's reservation\n");
+		goto bail;
+	}
+
+	if (query(a, info, 50, CLAMMA_ADMIT_QUEUE, &g) || run(a) < 1 ||
+	    !g.count) {
+		fprintf(stderr, "what fits beside the pool didn't run\n");
+		goto bail;
+	}
+
+	ret = 0;
+
+bail:
+	clamma_session_destroy(p);
+	clamma_session_destroy(a);
+	clamma_txf_destroy(t);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = "clamma-selftest-admission.bin";
+	struct txf_session *a, *b, *c, *d;
+	size_t big = 1u << 30, fixed, pp;
+	struct test_gather g[3];
+	clamma_txf_info_t info;
+	int ret = 1, n;
+	struct txf *t;
+
+	if (test_model_write(path, 0))
+		goto bail;
+
+	test_model_info(&info, path, argc > 1 ? argv[1] : "tokenizer.bin");
+	info.issue_cb = iss_cb;
+	info.prompt = "Once upon a time";
+	memset(g, 0, sizeof(g));
+
+	/*
+	 * Measure what a session and a kv cache position cost against a
+	 * budget, on a transformer whose budget won't run out
+	 */
+
+	info.mem_budget = big;
+	t = clamma_txf_construct(&info);
+	if (!t)
+		goto bail1;
+	a = clamma_session_construct(t);
+	if (!a) {
+		clamma_txf_destroy(t);
+		goto bail1;
+	}
+	fixed = big - clamma_txf_headroom(t);
+	n = query(a, &info, 10, CLAMMA_ADMIT_REJECT, &g[0]);
+	pp = (big - fixed - clamma_txf_headroom(t)) / 10;
+	clamma_session_destroy(a);
+	clamma_txf_destroy(t);
+	if (n || !fixed || !pp) {
+		fprintf(stderr, "unable to measure session costs\n");
+		goto bail1;
+	}
+
+	/* now a budget for three sessions, with 100 positions of kv cache */
+
+	info.mem_budget = (3 * fixed) + (100 * pp);
+	t = clamma_txf_construct(&info);
+	if (!t)
+		goto bail1;
+
+	a = clamma_session_construct(t);
+	b = clamma_session_construct(t);
+	c = clamma_session_construct(t);
+	d = clamma_session_construct(t);
+	if (!a || !b || !c) {
+		fprintf(stderr, "unable to construct sessions\n");
+		goto bail2;
+	}
+	if (d) {
+		fprintf(stderr, "constructed a session beyond the budget\n");
+		goto bail2;
+	}
+
+	if (query(a, &info, 80, CLAMMA_ADMIT_REJECT, &g[0]) ||
+	    clamma_txf_headroom(t) != 20 * pp) {
+		fprintf(stderr, "A not admitted\n");
+		goto bail2;
+	}
+
+	/* REJECT fails the query when it doesn't fit, and reserves nothing */
+
+	if (!query(b, &info, 50, CLAMMA_ADMIT_REJECT, &g[1]) ||
+	    clamma_txf_headroom(t) != 20 * pp ||
+	    clamma_session_step(b) != -1) {
+		fprintf(stderr, "B not rejected\n");
+		goto bail2;
+	}
+
+	/* SHRINK admits it with the limit that fits */
+
+	g[1].count = 0;
+	if (query(b, &info, 50, CLAMMA_ADMIT_SHRINK, &g[1]) ||
+	    clamma_txf_headroom(t) != 0) {
+		fprintf(stderr, "B not shrunk\n");
+		goto bail2;
+	}
+	n = run(b);
+	if (n < 1 || n > 20 || clamma_txf_headroom(t) != 20 * pp) {
+		fprintf(stderr, "B ran %d steps, over its shrunk limit\n", n);
+		goto bail2;
+	}
+
+	/* QUEUE rejects what can never fit, even with the others finished */
+
+	if (!query(c, &info, 101, CLAMMA_ADMIT_QUEUE, &g[2]) ||
+	    clamma_session_step(c) != -1) {
+		fprintf(stderr, "C queued beyond the budget\n");
+		goto bail2;
+	}
+
+	/* ... and waits for what will fit, until A releases enough */
+
+	g[2].count = 0;
+	if (query(c, &info, 100, CLAMMA_ADMIT_QUEUE, &g[2]) ||
+	    clamma_session_step(c) != -1 ||
+	    clamma_txf_headroom(t) != 20 * pp) {
+		fprintf(stderr, "C not waiting\n");
+		goto bail2;
+	}
+
+	if (run(a) < 1 || clamma_txf_headroom(t) != 0) {
+		fprintf(stderr, "C not admitted when A finished\n");
+		goto bail2;
+	}
+
+	if (run(c) < 1 || !g[2].count || clamma_txf_headroom(t) != 100 * pp) {
+		fprintf(stderr, "C didn't run\n");
+		goto bail2;
+	}
+
+	if (pool_case(&info, fixed, pp))
+		goto bail2;
+
+	ret = 0;
+
+bail2:
+	clamma_session_destroy(a);
+	clamma_session_destroy(b);
+	clamma_session_destroy(c);
+	clamma_session_destroy(d);
+
+	if (!ret && clamma_txf_headroom(t) != info.mem_budget) {
+		fprintf(stderr, "budget not all released\n");
+		ret = 1;
+	}
+
+	clamma_txf_destroy(t);
+	if (!ret)
+		printf("ALL OK\n");
+bail1:
+	unlink(path);
+bail:
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
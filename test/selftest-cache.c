@@ -0,0 +1,217 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-cache checks that float and int8 models give
+ * the same output from the malloc cache as from mmap, with a cache too small
+ * to hold the model, with and without the compressed tier and direct io, so
+ * the matmuls see weights spanning blocks and evicted ones coming back.  And
+ * that clamma_weight_read() of ranges across block boundaries matches the
+ * file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../lib/private.h"
+#include "test-model.h"
+
+#define TEST_READS		256
+
+struct test_gather {
+	char buf[4096];
+	size_t pos;
+};
+
+static const struct {
+	const char	*name;
+	size_t		limit; /* in blocks */
+	size_t		zlimit; /* in blocks */
+	unsigned int	direct_io;
+} configs[] = {
+	{ "cache",		6, 0, 0 },
+	{ "compressed",		6, 8, 0 },
+	{ "direct io",		6, 0, 1 },
+	{ "unlimited",		0, 0, 0 },
+};
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_gather *g = (struct test_gather *)opaque_user_pointer;
+
+	g->pos += snprintf(g->buf + g->pos, sizeof(g->buf) - g->pos, "%s",
+			   piece);
+
+	return 0;
+}
+
+static int
+run(clamma_txf_info_t *info, struct test_gather *g)
+{
+	struct txf_session *ts;
+	struct txf *t;
+	int r = 1;
+
+	memset(g, 0, sizeof(*g));
+	info->opaque_user_pointer = g;
+
+	t = clamma_txf_construct(info);
+	if (!t)
+		return 1;
+
+	ts = clamma_session_construct(t);
+	if (ts && !clamma_session_query(ts, info))
+		while ((r = clamma_session_step(ts)) == 1)
+			;
+
+	clamma_session_destroy(ts);
+	clamma_txf_destroy(t);
+
+	return r || !g->pos;
+}
+
+/* random ranges from the cache, crossing block boundaries, against the file */
+
+static int
+reads(clamma_txf_info_t *info, const char *path)
+{
+	uint8_t *a = NULL, *b = NULL;
+	uint64_t r = 0x5eed, ofs;
+	size_t len, max = 3 * CWC_BLOCK_SIZE;
+	int n, ret = 1;
+	FILE *f;
+	txf_t *t;
+
+	t = clamma_txf_construct(info);
+	if (!t)
+		return 1;
+
+	f = fopen(path, "rb");
+	a = malloc(max);
+	b = malloc(max);
+	if (!f || !a || !b)
+		goto bail;
+
+	for (n = 0; n < TEST_READS; n++) {
+		r = r * 6364136223846793005ull + 1442695040888963407ull;
+		ofs = (r >> 16) % (uint64_t)t->file_size;
+		len = (size_t)(r >> 40) % max + 1;
+
+		/* some right up against block boundaries and the end */
+		if (n & 1)
+			ofs = (ofs & ~((uint64_t)CWC_BLOCK_SIZE - 1)) - 1 -
+			      (uint64_t)(n & 6);
+		if (n % 16 == 2)
+			ofs = (uint64_t)t->file_size - len;
+		if (ofs >= (uint64_t)t->file_size)
+			ofs = 0;
+		if (ofs + len > (uint64_t)t->file_size)
+			len = (size_t)((uint64_t)t->file_size - ofs);
+
+		if (clamma_weight_read(t, a, (uint8_t *)t->data + ofs, len) ||
+		    fseek(f, (long)ofs, SEEK_SET) ||
+		    fread(b, 1, len, f) != len || memcmp(a, b, len)) {
+			fprintf(stderr, "read %zu at %llu differs\n", len,
+				(unsigned long long)ofs);
+			goto bail;
+		}
+	}
+
+	ret = 0;
+
+bail:
+	free(b);
+	free(a);
+	if (f)
+		fclose(f);
+	clamma_txf_destroy(t);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char * const paths[] = { "clamma-selftest-cache.bin",
+					      "clamma-selftest-cache-q8.bin" };
+	static struct test_gather ref, g;
+	clamma_txf_info_t info;
+	int ret = 1, m;
+	size_t n;
+
+	for (m = 0; m < 2; m++) {
+		if (test_model_write(paths[m], m))
+			goto bail;
+
+		test_model_info(&info, paths[m],
+				argc > 1 ? argv[1] : "tokenizer.bin");
+		info.issue_cb = iss_cb;
+		info.prompt = "Once upon a time";
+		info.limit = 40;
+
+		if (run(&info, &ref)) {
+			fprintf(stderr, "%s: mmap run failed\n", paths[m]);
+			goto bail;
+		}
+
+		info.model_access = CLAMMA_MODEL_ACCESS_MALLOC_CACHE;
+
+		for (n = 0; n < CLAMMA_ARRAY_SIZE(configs); n++) {
+			info.cache_limit = configs[n].limit * CWC_BLOCK_SIZE;
+			info.cache_compressed_limit = configs[n].zlimit *
+						      CWC_BLOCK_SIZE;
+			info.cache_direct_io = configs[n].direct_io;
+
+			if (run(&info, &g) || g.pos != ref.pos ||
+			    memcmp(g.buf, ref.buf, ref.pos)) {
+				fprintf(stderr, "%s: %s differs from mmap\n",
+					paths[m], configs[n].name);
+				goto bail;
+			}
+
+			if (reads(&info, paths[m])) {
+				fprintf(stderr, "%s: %s reads differ\n",
+					paths[m], configs[n].name);
+				goto bail;
+			}
+		}
+
+		unlink(paths[m]);
+	}
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail:
+	for (m = 0; m < 2; m++)
+		unlink(paths[m]);
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
@@ -0,0 +1,208 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-codec checks the compressed cache tier's
+ * codec round-trips random bytes, a single repeated byte, floats and skewed
+ * int8 values at lengths that are and aren't a multiple of four, that it
+ * declines without writing past out_max when the result won't fit, and that
+ * truncated or corrupt input is rejected.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "../lib/private.h"
+
+#define TEST_MAX		CWC_BLOCK_SIZE
+#define TEST_SLACK		1024 /* room for the headers over the input */
+#define TEST_GUARD		64
+
+typedef enum {
+	TD_RANDOM,
+	TD_SAME,
+	TD_FLOAT,
+	TD_INT8,
+} test_data_t;
+
+static const char * const data_names[] = {
+	"random", "same", "float", "int8"
+};
+
+static const size_t lengths[] = {
+	1, 3, 4, 5, 63, 64, 4095, 4096, 4097, TEST_MAX - 1, TEST_MAX
+};
+
+static uint64_t r = 0x5eed;
+
+static uint32_t
+rnd(void)
+{
+	r = r * 6364136223846793005ull + 1442695040888963407ull;
+
+	return (uint32_t)(r >> 32);
+}
+
+static void
+fill(uint8_t *p, size_t len, test_data_t type)
+{
+	size_t n;
+	float f;
+
+	for (n = 0; n < len; n++)
+		switch (type) {
+		case TD_RANDOM:
+			p[n] = (uint8_t)rnd();
+			break;
+		case TD_SAME:
+			p[n] = 0x5a;
+			break;
+		case TD_FLOAT:
+			/* weight-like values, a few exponents */
+			if (!(n & 3)) {
+				f = ((float)(rnd() >> 8) / (float)(1 << 24) -
+				     0.5f) * 0.2f;
+				memcpy(&p[n], &f, len - n < 4 ? len - n : 4);
+			}
+			break;
+		case TD_INT8:
+			/* clustered around zero */
+			p[n] = (uint8_t)(int8_t)(((int)(rnd() & 15) +
+					(int)(rnd() & 15) - 15) / 2);
+			break;
+		}
+}
+
+static int
+check(test_data_t type, size_t len, uint8_t *in, uint8_t *z, uint8_t *out)
+{
+	size_t zl, cut, zmax;
+
+	fill(in, len, type);
+
+	/* with room for it, it must always go, and come back the same */
+
+	zl = clamma_wz_compress(in, len, z, len + TEST_SLACK);
+	if (!zl || zl > len + TEST_SLACK) {
+		fprintf(stderr, "%s %zu: compress gave %zu\n",
+			data_names[type], len, zl);
+		return 1;
+	}
+
+	memset(out, 0xee, len + TEST_GUARD);
+	if (clamma_wz_decompress(z, zl, out, len) || memcmp(in, out, len)) {
+		fprintf(stderr, "%s %zu: round trip differs\n",
+			data_names[type], len);
+		return 1;
+	}
+	for (cut = len; cut < len + TEST_GUARD; cut++)
+		if (out[cut] != 0xee) {
+			fprintf(stderr, "%s %zu: decompress overran\n",
+				data_names[type], len);
+			return 1;
+		}
+
+	/*
+	 * Bigger blocks of repeats and weights must actually shrink... floats
+	 * only do when they can be split into byte planes
+	 */
+
+	if (len >= 4096 && type != TD_RANDOM &&
+	    (type != TD_FLOAT || !(len & 3)) && zl >= len) {
+		fprintf(stderr, "%s %zu: didn't compress (%zu)\n",
+			data_names[type], len, zl);
+		return 1;
+	}
+
+	/* with too little room, it declines and stays inside out_max */
+
+	zmax = zl - 1;
+	memset(z, 0xee, zmax + TEST_GUARD);
+	if (clamma_wz_compress(in, len, z, zmax)) {
+		fprintf(stderr, "%s %zu: fitted %zu in %zu\n",
+			data_names[type], len, zl, zmax);
+		return 1;
+	}
+	for (cut = zmax; cut < zmax + TEST_GUARD; cut++)
+		if (z[cut] != 0xee) {
+			fprintf(stderr, "%s %zu: compress overran out_max\n",
+				data_names[type], len);
+			return 1;
+		}
+
+	/* truncated input is rejected, not overrun */
+
+	zl = clamma_wz_compress(in, len, z, len + TEST_SLACK);
+	for (cut = 0; cut < zl; cut += cut < 256 ? 1 : 997)
+		if (!clamma_wz_decompress(z, cut, out, len)) {
+			fprintf(stderr, "%s %zu: took %zu of %zu\n",
+				data_names[type], len, cut, zl);
+			return 1;
+		}
+
+	/* and so is an unknown mode */
+
+	z[0] ^= 0x80;
+	if (!clamma_wz_decompress(z, zl, out, len)) {
+		fprintf(stderr, "%s %zu: took a bad mode\n",
+			data_names[type], len);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(void)
+{
+	uint8_t *in, *z, *out;
+	int ret = 1, type;
+	size_t n;
+
+	in = malloc(TEST_MAX);
+	z = malloc(TEST_MAX + TEST_SLACK + TEST_GUARD);
+	out = malloc(TEST_MAX + TEST_GUARD);
+	if (!in || !z || !out)
+		goto bail;
+
+	for (type = TD_RANDOM; type <= TD_INT8; type++)
+		for (n = 0; n < CLAMMA_ARRAY_SIZE(lengths); n++)
+			if (check((test_data_t)type, lengths[n], in, z, out))
+				goto bail;
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail:
+	free(out);
+	free(z);
+	free(in);
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
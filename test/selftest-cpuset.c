@@ -0,0 +1,94 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-cpuset checks parsing of info.cpus style cpu
+ * lists, and picking the nth cpu from the resulting set.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/private.h"
+
+static const struct {
+	const char	*list;
+	int		fails;
+	int		nth[6]; /* cpus 0 .. 5 of the set, -1 if empty */
+} tests[] = {
+	{ NULL,			0, { -1, -1, -1, -1, -1, -1 } },
+	{ "",			0, { -1, -1, -1, -1, -1, -1 } },
+	{ "3",			0, {  3,  3,  3,  3,  3,  3 } },
+	{ "0-3",		0, {  0,  1,  2,  3,  0,  1 } },
+	{ "8,2,5",		0, {  2,  5,  8,  2,  5,  8 } },
+	{ "0-1,10-11,64",	0, {  0,  1, 10, 11, 64,  0 } },
+	{ "4-6,5",		0, {  4,  5,  6,  4,  5,  6 } },
+	{ "1023",		0, { 1023, 1023, 1023, 1023, 1023, 1023 } },
+	{ "1,",			0, {  1,  1,  1,  1,  1,  1 } },
+	{ "1024",		1, { 0 } },
+	{ "0-1024",		1, { 0 } },
+	{ "3-1",		1, { 0 } },
+	{ "a",			1, { 0 } },
+	{ "1-",			1, { 0 } },
+	{ "-1",			1, { 0 } },
+	{ "1;2",		1, { 0 } },
+	{ "1,,2",		1, { 0 } },
+	{ "0 -3",		1, { 0 } },
+};
+
+int
+main(void)
+{
+	clamma_cpuset_t cs;
+	int ret = 0, r;
+	size_t n, m;
+
+	for (n = 0; n < CLAMMA_ARRAY_SIZE(tests); n++) {
+		r = clamma_cpuset_parse(&cs, tests[n].list);
+		if (!r != !tests[n].fails) {
+			fprintf(stderr, "\"%s\": parse gave %d\n",
+				tests[n].list ? tests[n].list : "(null)", r);
+			ret = 1;
+			continue;
+		}
+		if (r)
+			continue;
+
+		for (m = 0; m < CLAMMA_ARRAY_SIZE(tests[n].nth); m++)
+			if (clamma_cpuset_nth(&cs, (unsigned int)m) !=
+							tests[n].nth[m]) {
+				fprintf(stderr, "\"%s\": cpu %d is %d not %d\n",
+					tests[n].list ? tests[n].list :
+							"(null)", (int)m,
+					clamma_cpuset_nth(&cs, (unsigned int)m),
+					tests[n].nth[m]);
+				ret = 1;
+			}
+	}
+
+	printf(ret ? "FAILED\n" : "ALL OK\n");
+
+	return ret;
+}
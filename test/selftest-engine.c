@@ -0,0 +1,247 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-engine checks that the engine thread only
+ * steps sessions submitted to it, that their output is only issued from
+ * clamma_engine_drain() on the draining thread, and that the engine fd is
+ * readable exactly while some session has output left to drain.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "test-model.h"
+
+struct test_gather {
+	char buf[8192];
+	size_t pos;
+	unsigned int calls;
+	char ended;
+	char wrong_thread;
+};
+
+static pthread_t main_thread;
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_gather *g = (struct test_gather *)opaque_user_pointer;
+	size_t len = strlen(piece);
+
+	if (!pthread_equal(pthread_self(), main_thread))
+		g->wrong_thread = 1;
+
+	/* drained output is everything buffered, ending with any EOS */
+	if (len && piece[len - 1] == TOK_EOS) {
+		g->ended = 1;
+		len--;
+	}
+
+	g->pos += snprintf(g->buf + g->pos, sizeof(g->buf) - g->pos, "%.*s",
+			   (int)len, piece);
+	g->calls++;
+
+	return 0;
+}
+
+static int
+readable(int fd, int ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, ms) == 1 && (pfd.revents & POLLIN);
+}
+
+/* drain one session, or all, as the fd says, until they have ended */
+
+static int
+drain_until_ended(int fd, struct txf_session *ts, struct test_gather **g,
+		  int count)
+{
+	int n, done;
+
+	do {
+		if (!readable(fd, 5000)) {
+			fprintf(stderr, "%s: timed out\n", __func__);
+			return 1;
+		}
+
+		clamma_engine_drain(ts);
+
+		for (n = done = 0; n < count; n++)
+			done += g[n]->ended;
+	} while (done != count);
+
+	/* nothing more is coming, so it mustn't still look readable */
+
+	if (readable(fd, 0)) {
+		fprintf(stderr, "%s: fd still readable\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = "clamma-selftest-engine.bin";
+	struct txf_session *e1 = NULL, *e2 = NULL, *a = NULL;
+	struct test_gather *ge1, *ge2, *ga, *pg[2];
+	clamma_txf_info_t info;
+	int ret = 1, fd;
+	struct txf *t;
+
+	main_thread = pthread_self();
+
+	ge1 = calloc(3, sizeof(*ge1));
+	if (!ge1)
+		goto bail;
+	ge2 = ge1 + 1;
+	ga = ge1 + 2;
+
+	if (test_model_write(path, 0))
+		goto bail1;
+
+	test_model_info(&info, path, argc > 1 ? argv[1] : "tokenizer.bin");
+	info.issue_cb = iss_cb;
+	info.prompt = "Once upon a time";
+	info.limit = 24;
+
+	t = clamma_txf_construct(&info);
+	if (!t)
+		goto bail2;
+
+	if (clamma_engine_start())
+		goto bail3;
+	fd = clamma_engine_fd();
+
+	e1 = clamma_session_construct(t);
+	e2 = clamma_session_construct(t);
+	a = clamma_session_construct(t);
+	if (!e1 || !e2 || !a)
+		goto bail4;
+
+	/*
+	 * An app session queried alongside an engine session: the engine
+	 * must only step its own, and drain must clear the signal once the
+	 * only session with output was drained on its own
+	 */
+
+	info.opaque_user_pointer = ga;
+	if (clamma_session_query(a, &info))
+		goto bail4;
+	info.opaque_user_pointer = ge1;
+	if (clamma_engine_submit(e1, &info))
+		goto bail4;
+
+	pg[0] = ge1;
+	if (drain_until_ended(fd, e1, pg, 1))
+		goto bail4;
+
+	/*
+	 * The app session must still be where it started, just its prompt
+	 * issued... stepped to the end now, it gives the same output
+	 */
+
+	if (ga->calls != 1) {
+		fprintf(stderr, "app session stepped by the engine\n");
+		goto bail4;
+	}
+	while (clamma_session_step(a) == 1)
+		;
+	if (!ga->ended || ga->pos != ge1->pos ||
+	    memcmp(ga->buf, ge1->buf, ga->pos)) {
+		fprintf(stderr, "app and engine sessions differ\n");
+		goto bail4;
+	}
+
+	/* both engine sessions, drained together */
+
+	memset(ge1, 0, sizeof(*ge1));
+	info.opaque_user_pointer = ge1;
+	if (clamma_engine_submit(e1, &info))
+		goto bail4;
+	info.opaque_user_pointer = ge2;
+	if (clamma_engine_submit(e2, &info))
+		goto bail4;
+
+	pg[1] = ge2;
+	if (drain_until_ended(fd, NULL, pg, 2))
+		goto bail4;
+
+	if (!ge1->pos || ge1->pos != ge2->pos ||
+	    memcmp(ge1->buf, ge2->buf, ge1->pos)) {
+		fprintf(stderr, "engine sessions differ\n");
+		goto bail4;
+	}
+
+	/*
+	 * Given a query the usual way, an engine session is the app's again,
+	 * the engine leaves it alone and it calls its issue_cb directly
+	 */
+
+	memset(ge2, 0, sizeof(*ge2));
+	info.opaque_user_pointer = ge2;
+	if (clamma_session_query(e1, &info))
+		goto bail4;
+	while (clamma_session_step(e1) == 1)
+		;
+	if (!ge2->ended || ge2->calls < 2 || ge2->pos != ge1->pos ||
+	    readable(fd, 0)) {
+		fprintf(stderr, "requeried session still on the engine\n");
+		goto bail4;
+	}
+
+	if (ge1->wrong_thread || ge2->wrong_thread || ga->wrong_thread) {
+		fprintf(stderr, "issue_cb called from the engine thread\n");
+		goto bail4;
+	}
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail4:
+	clamma_engine_stop();
+	clamma_session_destroy(e1);
+	clamma_session_destroy(e2);
+	clamma_session_destroy(a);
+bail3:
+	clamma_txf_destroy(t);
+bail2:
+	unlink(path);
+bail1:
+	free(ge1);
+bail:
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
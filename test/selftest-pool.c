@@ -0,0 +1,180 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-pool checks that sessions from the
+ * transformer's preallocated pool are reused, keep their memory reserved
+ * while pooled, and give the same results each time they're reused.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "test-model.h"
+
+#define TEST_POOL 2
+
+struct test_gather {
+	char buf[4096];
+	size_t pos;
+};
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_gather *g = (struct test_gather *)opaque_user_pointer;
+
+	g->pos += snprintf(g->buf + g->pos, sizeof(g->buf) - g->pos, "%s",
+			   piece);
+
+	return 0;
+}
+
+static int
+run(struct txf_session *ts, clamma_txf_info_t *info, struct test_gather *g,
+    const char *prompt)
+{
+	int r;
+
+	memset(g, 0, sizeof(*g));
+	info->opaque_user_pointer = g;
+	info->prompt = prompt;
+	if (clamma_session_query(ts, info))
+		return 1;
+
+	while ((r = clamma_session_step(ts)) == 1)
+		;
+
+	return r;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = "clamma-selftest-pool.bin";
+	struct txf_session *ts[TEST_POOL + 1], *p;
+	struct test_gather g1, g2;
+	size_t h_pooled, h;
+	clamma_txf_info_t info;
+	int ret = 1, n;
+	struct txf *t;
+
+	if (test_model_write(path, 0))
+		goto bail;
+
+	test_model_info(&info, path, argc > 1 ? argv[1] : "tokenizer.bin");
+	info.issue_cb = iss_cb;
+	info.limit = 40;
+	info.session_pool = TEST_POOL;
+	info.mem_budget = 1u << 30;
+
+	t = clamma_txf_construct(&info);
+	if (!t)
+		goto bail1;
+
+	memset(ts, 0, sizeof(ts));
+
+	/* the pool is reserved against the budget up front */
+
+	h_pooled = clamma_txf_headroom(t);
+	if (h_pooled == info.mem_budget) {
+		fprintf(stderr, "pool not reserved\n");
+		goto bail2;
+	}
+
+	for (n = 0; n < TEST_POOL; n++) {
+		ts[n] = clamma_session_construct(t);
+		if (!ts[n])
+			goto bail2;
+	}
+	if (clamma_txf_headroom(t) != h_pooled) {
+		fprintf(stderr, "pooled sessions reserved more\n");
+		goto bail2;
+	}
+
+	/* past the pool, sessions are allocated and reserved as usual */
+
+	ts[TEST_POOL] = clamma_session_construct(t);
+	if (!ts[TEST_POOL] || clamma_txf_headroom(t) >= h_pooled) {
+		fprintf(stderr, "unpooled session not reserved\n");
+		goto bail2;
+	}
+
+	/* a pooled session gives the same results when it's reused */
+
+	if (run(ts[0], &info, &g1, "Once upon a time") ||
+	    run(ts[0], &info, &g2, "The dog") ||
+	    !g1.pos || !g2.pos) {
+		fprintf(stderr, "query failed\n");
+		goto bail2;
+	}
+
+	h = clamma_txf_headroom(t);
+	p = ts[0];
+	clamma_session_destroy(ts[0]);
+	ts[0] = clamma_session_construct(t);
+	if (ts[0] != p || clamma_txf_headroom(t) != h) {
+		fprintf(stderr, "pooled session not reused\n");
+		goto bail2;
+	}
+
+	if (run(ts[0], &info, &g2, "Once upon a time") ||
+	    g1.pos != g2.pos || memcmp(g1.buf, g2.buf, g1.pos)) {
+		fprintf(stderr, "reused session differs\n");
+		goto bail2;
+	}
+
+	/* and the same as one that was never pooled */
+
+	if (run(ts[TEST_POOL], &info, &g2, "Once upon a time") ||
+	    g1.pos != g2.pos || memcmp(g1.buf, g2.buf, g1.pos)) {
+		fprintf(stderr, "pooled and unpooled sessions differ\n");
+		goto bail2;
+	}
+
+	ret = 0;
+
+bail2:
+	for (n = 0; n <= TEST_POOL; n++)
+		clamma_session_destroy(ts[n]);
+
+	if (!ret && clamma_txf_headroom(t) != h_pooled) {
+		fprintf(stderr, "budget not released\n");
+		ret = 1;
+	}
+
+	clamma_txf_destroy(t);
+	if (!ret)
+		printf("ALL OK\n");
+bail1:
+	unlink(path);
+bail:
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
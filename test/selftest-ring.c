@@ -0,0 +1,195 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-ring checks the lock-free job ring: FIFO
+ * order and the empty and full cases from one thread, and then with several
+ * producer and consumer threads contending on it at once, that every job
+ * queued comes out exactly once, with its contents intact.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../lib/private.h"
+
+#define TEST_PRODUCERS		4
+#define TEST_CONSUMERS		4
+#define TEST_JOBS		50000 /* per producer */
+
+static job_ring_t ring;
+static atomic_int seen[TEST_PRODUCERS][TEST_JOBS];
+/* cells producers may still fill, the ring asserts if it's overfilled */
+static atomic_int room;
+static atomic_int consumed, corrupt, stop;
+
+static void
+job_fill(job_t *j, int producer, int seq)
+{
+	memset(j, 0, sizeof(*j));
+	j->i	= producer;
+	j->n	= seq;
+	j->d	= producer ^ seq;
+	j->dlim	= ~seq;
+}
+
+static void *
+producer(void *p)
+{
+	int m = (int)(intptr_t)p, n, r;
+	job_t j;
+
+	for (n = 0; n < TEST_JOBS; n++) {
+		/* wait for a free cell and claim it */
+		do {
+			if (atomic_load(&stop))
+				return NULL;
+			r = atomic_load(&room);
+			if (r <= 0)
+				sched_yield();
+		} while (r <= 0 ||
+			 !atomic_compare_exchange_weak(&room, &r, r - 1));
+
+		job_fill(&j, m, n);
+		clamma_job_enqueue(&ring, &j);
+	}
+
+	return NULL;
+}
+
+static void *
+consumer(void *p)
+{
+	job_t j;
+
+	(void)p;
+
+	while (!atomic_load(&stop) &&
+	       atomic_load(&consumed) < TEST_PRODUCERS * TEST_JOBS) {
+		if (clamma_job_dequeue(&ring, &j)) {
+			sched_yield();
+			continue;
+		}
+
+		atomic_fetch_add(&room, 1);
+		atomic_fetch_add(&consumed, 1);
+
+		if (j.i < 0 || j.i >= TEST_PRODUCERS || j.n < 0 ||
+		    j.n >= TEST_JOBS || j.d != (j.i ^ j.n) || j.dlim != ~j.n) {
+			atomic_fetch_add(&corrupt, 1);
+			continue;
+		}
+
+		atomic_fetch_add(&seen[j.i][j.n], 1);
+	}
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t pt[TEST_PRODUCERS + TEST_CONSUMERS];
+	int ret = 1, n, m;
+	job_t j;
+
+	clamma_job_ring_init(&ring);
+
+	/* from one thread, it's a FIFO that can be filled to the brim */
+
+	if (!clamma_job_dequeue(&ring, &j)) {
+		fprintf(stderr, "new ring not empty\n");
+		goto bail;
+	}
+
+	for (m = 0; m < 3; m++) {
+		for (n = 0; n < LIBCLAMMA_MAX_THREAD_JOB_QUEUE; n++) {
+			job_fill(&j, 0, n);
+			clamma_job_enqueue(&ring, &j);
+		}
+		for (n = 0; n < LIBCLAMMA_MAX_THREAD_JOB_QUEUE; n++)
+			if (clamma_job_dequeue(&ring, &j) || j.n != n) {
+				fprintf(stderr, "job %d out of order\n", n);
+				goto bail;
+			}
+		if (!clamma_job_dequeue(&ring, &j)) {
+			fprintf(stderr, "drained ring not empty\n");
+			goto bail;
+		}
+	}
+
+	/* and now with everyone at it at once */
+
+	atomic_init(&room, LIBCLAMMA_MAX_THREAD_JOB_QUEUE);
+
+	for (n = 0; n < TEST_CONSUMERS; n++)
+		if (pthread_create(&pt[n], NULL, consumer, NULL))
+			break;
+	for (m = 0; n == TEST_CONSUMERS + m && m < TEST_PRODUCERS; m++)
+		if (!pthread_create(&pt[n], NULL, producer,
+				    (void *)(intptr_t)m))
+			n++;
+
+	if (n != TEST_CONSUMERS + TEST_PRODUCERS) {
+		/* couldn't start them all, have the ones we did give up */
+		fprintf(stderr, "thread creation failed\n");
+		atomic_store(&stop, 1);
+	}
+
+	while (n--)
+		pthread_join(pt[n], NULL);
+
+	if (atomic_load(&stop))
+		goto bail;
+
+	if (atomic_load(&corrupt)) {
+		fprintf(stderr, "%d jobs corrupted\n", atomic_load(&corrupt));
+		goto bail;
+	}
+
+	for (m = 0; m < TEST_PRODUCERS; m++)
+		for (n = 0; n < TEST_JOBS; n++)
+			if (atomic_load(&seen[m][n]) != 1) {
+				fprintf(stderr, "job %d/%d seen %d times\n",
+					m, n, atomic_load(&seen[m][n]));
+				goto bail;
+			}
+
+	if (!clamma_job_dequeue(&ring, &j)) {
+		fprintf(stderr, "ring not empty after\n");
+		goto bail;
+	}
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail:
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
@@ -0,0 +1,233 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-sched checks the intrusive list the run
+ * queues are made from, and then that sessions on the run queues are all
+ * stepped in turn, and cancelled ones reaped ahead of the others.
+ */
+
+#include "../lib/private.h"
+#include "test-model.h"
+
+#define TEST_SESSIONS 3
+
+struct test_gather {
+	char buf[4096];
+	size_t pos;
+	unsigned int count;
+	unsigned int *last; /* shared: which session issued last */
+	unsigned int run; /* how many times in a row we issued */
+	unsigned int max_run;
+	unsigned int id;
+	char ended;
+};
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_gather *g = (struct test_gather *)opaque_user_pointer;
+
+	if (piece[0] == TOK_EOS) {
+		g->ended = 1;
+		return 0;
+	}
+
+	g->run = *g->last == g->id ? g->run + 1 : 1;
+	if (g->run > g->max_run)
+		g->max_run = g->run;
+	*g->last = g->id;
+
+	g->pos += snprintf(g->buf + g->pos, sizeof(g->buf) - g->pos, "%s",
+			   piece);
+	g->count++;
+
+	return 0;
+}
+
+static int
+test_dll2(void)
+{
+	static const int order[] = { 1, 0, 2 };
+	clamma_dll2_t d[4], *p;
+	clamma_dll2_owner_t o;
+	int n;
+
+	memset(d, 0, sizeof(d));
+	memset(&o, 0, sizeof(o));
+
+	/* 3, 0, 1, 2 */
+	clamma_dll2_add_tail(&d[0], &o);
+	clamma_dll2_add_tail(&d[1], &o);
+	clamma_dll2_add_tail(&d[2], &o);
+	clamma_dll2_add_head(&d[3], &o);
+
+	if (o.count != 4 || o.head != &d[3] || o.tail != &d[2] ||
+	    d[3].next != &d[0] || d[2].prev != &d[1]) {
+		fprintf(stderr, "%s: bad order after add\n", __func__);
+		return 1;
+	}
+
+	/* removing from the middle, the head and the tail */
+	clamma_dll2_remove(&d[0]);
+	if (o.count != 3 || d[0].owner || d[3].next != &d[1] ||
+	    d[1].prev != &d[3]) {
+		fprintf(stderr, "%s: bad middle remove\n", __func__);
+		return 1;
+	}
+	clamma_dll2_remove(&d[3]);
+	clamma_dll2_remove(&d[2]);
+	if (o.count != 1 || o.head != &d[1] || o.tail != &d[1] ||
+	    d[1].prev || d[1].next) {
+		fprintf(stderr, "%s: bad head / tail remove\n", __func__);
+		return 1;
+	}
+
+	/* removing something not on a list does nothing */
+	clamma_dll2_remove(&d[2]);
+	if (o.count != 1) {
+		fprintf(stderr, "%s: bad remove of unlisted\n", __func__);
+		return 1;
+	}
+
+	/* pop gives them back in order and leaves it empty */
+	clamma_dll2_add_tail(&d[0], &o);
+	clamma_dll2_add_tail(&d[2], &o);
+	for (n = 0; (p = clamma_dll2_pop_head(&o)); n++)
+		if (n >= 3 || p != &d[order[n]] || p->owner) {
+			fprintf(stderr, "%s: bad pop %d\n", __func__, n);
+			return 1;
+		}
+
+	if (n != 3 || o.count || o.head || o.tail) {
+		fprintf(stderr, "%s: bad empty\n", __func__);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct test_gather gather[TEST_SESSIONS];
+	struct txf_session *ts[TEST_SESSIONS];
+	const char *path = "clamma-selftest-sched.bin";
+	unsigned int last = ~0u, count;
+	clamma_txf_info_t info;
+	int ret = 1, n, steps;
+	struct txf *t;
+
+	if (test_dll2())
+		goto bail;
+
+	if (test_model_write(path, 0))
+		goto bail;
+
+	test_model_info(&info, path, argc > 1 ? argv[1] : "tokenizer.bin");
+
+	t = clamma_txf_construct(&info);
+	if (!t)
+		goto bail1;
+
+	memset(gather, 0, sizeof(gather));
+	memset(ts, 0, sizeof(ts));
+	for (n = 0; n < TEST_SESSIONS; n++) {
+		gather[n].last = &last;
+		gather[n].id = (unsigned int)n;
+		ts[n] = clamma_session_construct(t);
+		if (!ts[n])
+			goto bail2;
+	}
+
+	/* not queried, so not on any run queue */
+	if (clamma_session_step(ts[0]) != -1) {
+		fprintf(stderr, "stepped an idle session\n");
+		goto bail2;
+	}
+
+	for (n = 0; n < TEST_SESSIONS; n++) {
+		info.opaque_user_pointer = &gather[n];
+		info.issue_cb = iss_cb;
+		info.null_on_destroy = (void **)&ts[n];
+		info.prompt = "Once upon a time";
+		info.limit = 32;
+		if (clamma_session_query(ts[n], &info))
+			goto bail2;
+	}
+
+	/* the query issues its prompt, we only want what it generates */
+	for (n = 0; n < TEST_SESSIONS; n++)
+		gather[n].pos = gather[n].count = gather[n].max_run = 0;
+	last = ~0u;
+
+	/* a cancelled session is reaped by the next step, ahead of the rest */
+	clamma_sessions_query_cancel(ts[2]);
+	clamma_sessions_step_next();
+	if (ts[2] || gather[0].count || gather[1].count) {
+		fprintf(stderr, "cancelled session not reaped first\n");
+		goto bail2;
+	}
+
+	for (steps = 0; clamma_sessions_step_next(); steps++)
+		if (steps > 4 * 32) {
+			fprintf(stderr, "sessions didn't finish\n");
+			goto bail2;
+		}
+
+	/*
+	 * Both ran the same greedy query, so they must have issued the same
+	 * output... and they took turns, neither issued more than two in a
+	 * row (when one goes over to decode first, it can be picked again)
+	 */
+
+	count = gather[0].count;
+	if (ts[0] || ts[1] || !gather[0].ended || !gather[1].ended || !count ||
+	    gather[1].count != count || gather[0].pos != gather[1].pos ||
+	    memcmp(gather[0].buf, gather[1].buf, gather[0].pos)) {
+		fprintf(stderr, "sessions didn't finish alike\n");
+		goto bail2;
+	}
+
+	if (gather[0].max_run > 2 || gather[1].max_run > 2) {
+		fprintf(stderr, "sessions didn't take turns: %u %u\n",
+				gather[0].max_run, gather[1].max_run);
+		goto bail2;
+	}
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail2:
+	for (n = 0; n < TEST_SESSIONS; n++)
+		clamma_session_destroy(ts[n]);
+	clamma_txf_destroy(t);
+bail1:
+	unlink(path);
+bail:
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
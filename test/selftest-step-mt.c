@@ -0,0 +1,174 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * This test app clamma-selftest-step-mt checks that sessions on a float and
+ * an int8 transformer, each stepped by its own application thread with
+ * clamma_session_step() all at the same time, produce the same output as when
+ * they're stepped one after the other.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "test-model.h"
+
+#define TEST_TXF		2
+#define TEST_PER_TXF		3
+#define TEST_SESSIONS		(TEST_TXF * TEST_PER_TXF)
+
+static const char * const prompts[] = {
+	"Once upon a time", "The dog", "Lily wanted",
+	"One day", "The big red ball", "Tom and Sue",
+};
+
+struct test_session {
+	struct txf_session *ts;
+	char buf[4096];
+	size_t pos;
+	int r;
+};
+
+static int
+iss_cb(void *opaque_user_pointer, const char *piece)
+{
+	struct test_session *s = (struct test_session *)opaque_user_pointer;
+
+	s->pos += snprintf(s->buf + s->pos, sizeof(s->buf) - s->pos, "%s",
+			   piece);
+
+	return 0;
+}
+
+static void *
+stepper(void *p)
+{
+	struct test_session *s = (struct test_session *)p;
+
+	while ((s->r = clamma_session_step(s->ts)) == 1)
+		;
+
+	return NULL;
+}
+
+static int
+query_all(struct test_session *s, clamma_txf_info_t *info)
+{
+	int n;
+
+	for (n = 0; n < TEST_SESSIONS; n++) {
+		s[n].pos = 0;
+		info->opaque_user_pointer = &s[n];
+		info->prompt = prompts[n];
+		if (clamma_session_query(s[n].ts, info))
+			return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char * const paths[] = { "clamma-selftest-step-mt.bin",
+					      "clamma-selftest-step-mt-q8.bin" };
+	static struct test_session ref[TEST_SESSIONS], mt[TEST_SESSIONS];
+	pthread_t pt[TEST_SESSIONS];
+	struct txf *t[TEST_TXF];
+	clamma_txf_info_t info;
+	int ret = 1, n;
+
+	memset(t, 0, sizeof(t));
+
+	for (n = 0; n < TEST_TXF; n++) {
+		if (test_model_write(paths[n], n))
+			goto bail;
+
+		test_model_info(&info, paths[n],
+				argc > 1 ? argv[1] : "tokenizer.bin");
+		info.issue_cb = iss_cb;
+		info.limit = 48;
+
+		t[n] = clamma_txf_construct(&info);
+		if (!t[n])
+			goto bail;
+	}
+
+	for (n = 0; n < TEST_SESSIONS; n++) {
+		ref[n].ts = clamma_session_construct(t[n / TEST_PER_TXF]);
+		mt[n].ts = clamma_session_construct(t[n / TEST_PER_TXF]);
+		if (!ref[n].ts || !mt[n].ts)
+			goto bail;
+	}
+
+	/* the reference results, stepping one session at a time */
+
+	if (query_all(ref, &info))
+		goto bail;
+	for (n = 0; n < TEST_SESSIONS; n++)
+		stepper(&ref[n]);
+
+	/* and now all at once, each from its own thread */
+
+	if (query_all(mt, &info))
+		goto bail;
+	for (n = 0; n < TEST_SESSIONS; n++)
+		if (pthread_create(&pt[n], NULL, stepper, &mt[n])) {
+			while (n--)
+				pthread_join(pt[n], NULL);
+			goto bail;
+		}
+	for (n = 0; n < TEST_SESSIONS; n++)
+		pthread_join(pt[n], NULL);
+
+	for (n = 0; n < TEST_SESSIONS; n++)
+		if (ref[n].r || mt[n].r || !ref[n].pos ||
+		    ref[n].pos != mt[n].pos ||
+		    memcmp(ref[n].buf, mt[n].buf, ref[n].pos)) {
+			fprintf(stderr, "session %d differs\n", n);
+			goto bail;
+		}
+
+	ret = 0;
+	printf("ALL OK\n");
+
+bail:
+	for (n = 0; n < TEST_SESSIONS; n++) {
+		clamma_session_destroy(ref[n].ts);
+		clamma_session_destroy(mt[n].ts);
+	}
+	for (n = 0; n < TEST_TXF; n++) {
+		if (t[n])
+			clamma_txf_destroy(t[n]);
+		unlink(paths[n]);
+	}
+	if (ret)
+		printf("FAILED\n");
+
+	return ret;
+}
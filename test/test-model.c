@@ -0,0 +1,189 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "test-model.h"
+
+#define HEAD_SIZE	(TEST_MODEL_DIM / TEST_MODEL_HEADS)
+#define KV_DIM		(HEAD_SIZE * TEST_MODEL_KV_HEADS)
+
+/*
+ * Write a tensor of layers x per values, each bias +/- scale, from a seeded
+ * generator so the float and int8 models get the same weights.  For int8
+ * models, each layer is written as its quantized values then its scales.
+ */
+
+static int
+tensor(FILE *f, uint64_t seed, size_t layers, size_t per, float bias,
+       float scale, int int8)
+{
+	uint64_t r = seed * 0x9e3779b97f4a7c15ull + 1;
+	int8_t *q = NULL;
+	float *v, *s;
+	size_t n, g;
+	int ret = 1;
+
+	v = malloc(per * sizeof(float));
+	if (!v)
+		return 1;
+
+	if (int8) {
+		q = malloc(per + (per / TEST_MODEL_GROUP_SIZE) * sizeof(float));
+		if (!q)
+			goto bail;
+	}
+
+	while (layers--) {
+		for (n = 0; n < per; n++) {
+			r = r * 6364136223846793005ull + 1442695040888963407ull;
+			v[n] = bias + scale * (((float)(r >> 40) /
+						(float)(1ull << 23)) - 1.0f);
+		}
+
+		if (!int8) {
+			if (fwrite(v, sizeof(float), per, f) != per)
+				goto bail;
+			continue;
+		}
+
+		s = (float *)(q + per);
+		for (g = 0; g < per / TEST_MODEL_GROUP_SIZE; g++) {
+			float m = 0.0f;
+
+			for (n = 0; n < TEST_MODEL_GROUP_SIZE; n++)
+				if (fabsf(v[g * TEST_MODEL_GROUP_SIZE + n]) > m)
+					m = fabsf(v[g * TEST_MODEL_GROUP_SIZE + n]);
+
+			s[g] = m / 127.0f;
+			for (n = 0; n < TEST_MODEL_GROUP_SIZE; n++)
+				q[g * TEST_MODEL_GROUP_SIZE + n] = (int8_t)
+					roundf(v[g * TEST_MODEL_GROUP_SIZE + n] /
+					       (s[g] ? s[g] : 1.0f));
+		}
+
+		n = per + (per / TEST_MODEL_GROUP_SIZE) * sizeof(float);
+		if (fwrite(q, 1, n, f) != n)
+			goto bail;
+	}
+
+	ret = 0;
+
+bail:
+	free(q);
+	free(v);
+
+	return ret;
+}
+
+int
+test_model_write(const char *path, int int8)
+{
+	uint32_t hdr[] = { TEST_MODEL_DIM, TEST_MODEL_HIDDEN, TEST_MODEL_LAYERS,
+			   TEST_MODEL_HEADS, TEST_MODEL_KV_HEADS,
+			   TEST_MODEL_VOCAB, TEST_MODEL_SEQ_LEN };
+	const size_t L = TEST_MODEL_LAYERS, D = TEST_MODEL_DIM,
+		     H = TEST_MODEL_HIDDEN;
+	uint8_t v2[256];
+	int ret = 1;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		fprintf(stderr, "%s: can't create %s\n", __func__, path);
+		return 1;
+	}
+
+	if (int8) {
+		uint32_t magic[] = { 0x616b3432, 2 }, gs = TEST_MODEL_GROUP_SIZE;
+
+		memset(v2, 0, sizeof(v2));
+		memcpy(v2, magic, sizeof(magic));
+		memcpy(v2 + sizeof(magic), hdr, sizeof(hdr));
+		v2[sizeof(magic) + sizeof(hdr)] = 1; /* shared classifier */
+		memcpy(v2 + sizeof(magic) + sizeof(hdr) + 1, &gs, sizeof(gs));
+
+		if (fwrite(v2, sizeof(v2), 1, f) != 1 ||
+		    /* the norm weights are all first, and stay float */
+		    tensor(f, 1, L, D, 1.0f, 0.1f, 0) ||
+		    tensor(f, 6, L, D, 1.0f, 0.1f, 0) ||
+		    tensor(f, 10, 1, D, 1.0f, 0.1f, 0) ||
+		    tensor(f, 0, 1, TEST_MODEL_VOCAB * D, 0.0f, 0.5f, 1) ||
+		    tensor(f, 2, L, D * D, 0.0f, 0.15f, 1) ||
+		    tensor(f, 3, L, D * KV_DIM, 0.0f, 0.15f, 1) ||
+		    tensor(f, 4, L, D * KV_DIM, 0.0f, 0.15f, 1) ||
+		    tensor(f, 5, L, D * D, 0.0f, 0.15f, 1) ||
+		    tensor(f, 7, L, D * H, 0.0f, 0.15f, 1) ||
+		    tensor(f, 8, L, H * D, 0.0f, 0.15f, 1) ||
+		    tensor(f, 9, L, D * H, 0.0f, 0.15f, 1))
+			goto bail;
+	} else
+		if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+		    tensor(f, 0, 1, TEST_MODEL_VOCAB * D, 0.0f, 0.5f, 0) ||
+		    tensor(f, 1, L, D, 1.0f, 0.1f, 0) ||
+		    tensor(f, 2, L, D * D, 0.0f, 0.15f, 0) ||
+		    tensor(f, 3, L, D * KV_DIM, 0.0f, 0.15f, 0) ||
+		    tensor(f, 4, L, D * KV_DIM, 0.0f, 0.15f, 0) ||
+		    tensor(f, 5, L, D * D, 0.0f, 0.15f, 0) ||
+		    tensor(f, 6, L, D, 1.0f, 0.1f, 0) ||
+		    tensor(f, 7, L, D * H, 0.0f, 0.15f, 0) ||
+		    tensor(f, 8, L, H * D, 0.0f, 0.15f, 0) ||
+		    tensor(f, 9, L, D * H, 0.0f, 0.15f, 0) ||
+		    tensor(f, 10, 1, D, 1.0f, 0.1f, 0) ||
+		    /* what used to be the RoPE freq_cis tables */
+		    tensor(f, 11, 1, TEST_MODEL_SEQ_LEN * HEAD_SIZE, 0.0f,
+			   0.0f, 0))
+			goto bail;
+
+	ret = 0;
+
+bail:
+	if (fclose(f))
+		ret = 1;
+	if (ret)
+		fprintf(stderr, "%s: failed writing %s\n", __func__, path);
+
+	return ret;
+}
+
+void
+test_model_info(clamma_txf_info_t *info, const char *path,
+		const char *tokenizer_path)
+{
+	memset(info, 0, sizeof(*info));
+	info->clamma_api_version = CLAMMA_API_VERSION;
+	info->model_access = CLAMMA_MODEL_ACCESS_MMAP;
+	info->checkpoint_path = path;
+	info->tokenizer_path = tokenizer_path;
+	info->threads = 2;
+	info->temperature = 0.0f; /* ie, greedy and deterministic */
+	info->rng_seed = 0x1234;
+	info->topp = 0.9f;
+}
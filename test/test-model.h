@@ -0,0 +1,64 @@
+/*
+ * libclamma - llama2 C library derived from llama2.c
+ *
+ * See https://github.com/karpathy/llama2.c for MIT-licensed original
+ *
+ * Changes Copyright (C) 2023 Andy Green <andy@warmcat.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Helpers shared by the selftests that don't need a real model... they write
+ * a small model checkpoint with deterministic pseudorandom weights, which
+ * produces nonsense, but always the same nonsense.
+ */
+
+#if !defined(__CLAMMA_TEST_MODEL_H__)
+#define __CLAMMA_TEST_MODEL_H__
+
+#include "clamma.h"
+
+/* the shape of the test model, the vocab size matches tokenizer.bin */
+
+#define TEST_MODEL_DIM		64
+#define TEST_MODEL_HIDDEN	1024
+#define TEST_MODEL_LAYERS	2
+#define TEST_MODEL_HEADS	4
+#define TEST_MODEL_KV_HEADS	2
+#define TEST_MODEL_VOCAB	32000
+#define TEST_MODEL_SEQ_LEN	128
+#define TEST_MODEL_GROUP_SIZE	32
+
+/*
+ * Write the test model to path, as a version 1 float checkpoint, or a version
+ * 2 int8 one if int8 is set.  Returns 0 if written.
+ */
+
+int
+test_model_write(const char *path, int int8);
+
+/*
+ * Prepare info to construct a transformer on the test model at path, with
+ * the tokenizer at tokenizer_path, and for deterministic queries
+ */
+
+void
+test_model_info(clamma_txf_info_t *info, const char *path,
+		const char *tokenizer_path);
+
+#endif